@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Create and unlink files from several threads at once, each thread in its
+ * own directory, and report the combined rate.
+ *
+ * Usage: create_unlink DIR THREADS SECONDS
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Files each thread keeps around before unlinking them again. */
+#define BATCH 64
+
+static const char *root;
+static atomic_int stop;
+
+struct worker {
+	pthread_t thread;
+	int id;
+	unsigned long ops;
+};
+
+static void die(const char *what, const char *path)
+{
+	fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+static void *work(void *arg)
+{
+	struct worker *w = arg;
+	char dir[4096], path[4096 + 32];
+	int i, fd;
+
+	snprintf(dir, sizeof(dir), "%s/t%d", root, w->id);
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		die("mkdir", dir);
+
+	while (!atomic_load(&stop)) {
+		for (i = 0; i < BATCH; i++) {
+			snprintf(path, sizeof(path), "%s/f%d", dir, i);
+			fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+			if (fd < 0)
+				die("create", path);
+			close(fd);
+		}
+		for (i = 0; i < BATCH; i++) {
+			snprintf(path, sizeof(path), "%s/f%d", dir, i);
+			if (unlink(path))
+				die("unlink", path);
+		}
+		w->ops += 2 * BATCH;
+	}
+
+	rmdir(dir);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker *workers;
+	struct timespec start, end;
+	unsigned long total = 0;
+	double secs;
+	int nr, i;
+
+	if (argc != 4) {
+		fprintf(stderr, "usage: %s DIR THREADS SECONDS\n", argv[0]);
+		return 1;
+	}
+	root = argv[1];
+	nr = atoi(argv[2]);
+
+	workers = calloc(nr, sizeof(*workers));
+	if (!workers)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr; i++) {
+		workers[i].id = i;
+		pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+	}
+	sleep(atoi(argv[3]));
+	atomic_store(&stop, 1);
+	for (i = 0; i < nr; i++) {
+		pthread_join(workers[i].thread, NULL);
+		total += workers[i].ops;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%3d threads: %10.0f ops/s\n", nr, total / secs);
+	free(workers);
+	return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Measure how create/unlink throughput scales with the number of threads.
+#
+# Formats a loop device as pantryfs and runs bench/create_unlink.c with 1, 2,
+# 4, ... threads up to the number of CPUs. Each thread creates and unlinks
+# files in a directory of its own, so the threads only contend on
+# filesystem-wide state. Must be run as root from the repository root after
+# building the module and format_disk_as_pantryfs.
+#
+# Arguments: [seconds per run] [image size in MiB]
+
+set -e
+
+SECS=${1:-10}
+SIZE_MB=${2:-1024}
+IMG=$(mktemp /tmp/pantryfs-bench.XXXXXX)
+MNT=$(mktemp -d /tmp/pantryfs-mnt.XXXXXX)
+BIN=$(mktemp /tmp/create_unlink.XXXXXX)
+
+cleanup() {
+	umount "$MNT" 2>/dev/null || true
+	[ -n "$LOOP" ] && losetup -d "$LOOP"
+	rmdir "$MNT"
+	rm -f "$IMG" "$BIN"
+}
+trap cleanup EXIT
+
+gcc -O2 -Wall -pthread -o "$BIN" bench/create_unlink.c
+
+truncate -s "${SIZE_MB}M" "$IMG"
+LOOP=$(losetup --find --show "$IMG")
+./format_disk_as_pantryfs "$LOOP" >/dev/null
+lsmod | grep -q '^mypantry ' || insmod mypantry.ko
+mount -t mypantryfs "$LOOP" "$MNT"
+
+THREADS=1
+while [ "$THREADS" -le "$(nproc)" ]; do
+	"$BIN" "$MNT" "$THREADS" "$SECS"
+	THREADS=$((THREADS * 2))
+done
@@ -0,0 +1,55 @@
+#!/bin/bash
+# Measure the CPU time spent per GiB of cold sequential reads.
+#
+# Formats a loop device as pantryfs, writes a large file, then reads it back
+# in 1 MiB requests with a cold page cache, once with the stream_ra_kb module
+# parameter set to 0 (the device's readahead window) and once with it at the
+# given value. Reports user + system CPU seconds per GiB read. Must be run as
+# root from the repository root after building the module and
+# format_disk_as_pantryfs.
+#
+# Arguments: [file size in GiB] [stream_ra_kb to compare against]
+
+set -e
+
+SIZE_GB=${1:-4}
+RA_KB=${2:-2048}
+PARAM=/sys/module/mypantry/parameters/stream_ra_kb
+IMG=$(mktemp /tmp/pantryfs-bench.XXXXXX)
+MNT=$(mktemp -d /tmp/pantryfs-mnt.XXXXXX)
+
+cleanup() {
+	umount "$MNT" 2>/dev/null || true
+	[ -n "$LOOP" ] && losetup -d "$LOOP"
+	rmdir "$MNT"
+	rm -f "$IMG"
+}
+trap cleanup EXIT
+
+truncate -s $((SIZE_GB + 1))G "$IMG"
+LOOP=$(losetup --find --show "$IMG")
+./format_disk_as_pantryfs "$LOOP" >/dev/null
+lsmod | grep -q '^mypantry ' || insmod mypantry.ko
+mount -t mypantryfs "$LOOP" "$MNT"
+
+dd if=/dev/zero of="$MNT/big" bs=1M count=$((SIZE_GB * 1024)) conv=fsync \
+	status=none
+OLD_RA=$(cat "$PARAM")
+
+run() {
+	local t
+
+	echo "$1" > "$PARAM"
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+	# The window is picked when the file is opened.
+	t=$( { TIMEFORMAT='%U %S'; time dd if="$MNT/big" of=/dev/null bs=1M \
+		status=none; } 2>&1 )
+	echo "$t" | awk -v ra="$1" -v gb="$SIZE_GB" \
+		'{ printf "stream_ra_kb %5s: %.3f CPU s/GiB (user %.3f, sys %.3f)\n",
+		   ra, ($1 + $2) / gb, $1 / gb, $2 / gb }'
+}
+
+run 0
+run "$RA_KB"
+echo "$OLD_RA" > "$PARAM"
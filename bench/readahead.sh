@@ -0,0 +1,48 @@
+#!/bin/bash
+# Compare sequential read throughput with readahead on and off.
+#
+# Formats a loop device as pantryfs, writes a large file, then reads it back
+# in 1 MiB requests with a cold page cache, once with the device's readahead
+# window set to 0 and once with it restored. Must be run as root from the
+# repository root after building the module and format_disk_as_pantryfs.
+#
+# Arguments: [file size in MiB] [readahead in KiB]
+
+set -e
+
+SIZE_MB=${1:-512}
+RA_KB=${2:-1024}
+IMG=$(mktemp /tmp/pantryfs-bench.XXXXXX)
+MNT=$(mktemp -d /tmp/pantryfs-mnt.XXXXXX)
+
+cleanup() {
+	umount "$MNT" 2>/dev/null || true
+	[ -n "$LOOP" ] && losetup -d "$LOOP"
+	rmdir "$MNT"
+	rm -f "$IMG"
+}
+trap cleanup EXIT
+
+truncate -s $((SIZE_MB * 2))M "$IMG"
+LOOP=$(losetup --find --show "$IMG")
+./format_disk_as_pantryfs "$LOOP" >/dev/null
+lsmod | grep -q '^mypantry ' || insmod mypantry.ko
+mount -t mypantryfs "$LOOP" "$MNT"
+
+dd if=/dev/zero of="$MNT/big" bs=1M count="$SIZE_MB" conv=fsync status=none
+
+# The fs reads through the bdi of the device it is mounted on.
+BDI=/sys/class/bdi/$(lsblk -dno MAJ:MIN "$LOOP" | tr -d ' ')/read_ahead_kb
+OLD_RA=$(cat "$BDI")
+
+run() {
+	echo "$1" > "$BDI"
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+	printf 'readahead %5s KiB: ' "$1"
+	dd if="$MNT/big" of=/dev/null bs=1M 2>&1 | tail -n 1
+}
+
+run 0
+run "$RA_KB"
+echo "$OLD_RA" > "$BDI"
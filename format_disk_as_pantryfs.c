@@ -40,98 +40,230 @@ void inode_reset(struct pantryfs_inode *inode)
 	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time;
 }
 
-void dentry_reset(struct pantryfs_dir_entry *dentry)
+/* Give the inode a one-block extent map starting at the given block. */
+void inode_map_block(struct pantryfs_inode *inode, uint64_t block)
 {
-	memset(dentry, 0, sizeof(*dentry));
+	inode->ext_count = 1;
+	inode->extents[0].ee_block = 0;
+	inode->extents[0].ee_len = 1;
+	inode->extents[0].ee_start = block;
+}
+
+/* Fill the directory block with a single entry spanning all of it. */
+void dir_block_init(char *block, const char *name, uint64_t inode_no,
+		uint8_t file_type)
+{
+	struct pantryfs_dir_entry *dentry = (struct pantryfs_dir_entry *) block;
+
+	memset(block, 0, PFS_BLOCK_SIZE);
+	dentry->inode_no = inode_no;
+	dentry->rec_len = PFS_BLOCK_SIZE;
+	dentry->name_len = strlen(name);
+	dentry->file_type = file_type;
+	memcpy(dentry->filename, name, dentry->name_len);
+}
+
+/* Default number of device bytes per inode, like mke2fs's -i option. */
+#define DEFAULT_BYTES_PER_INODE 16384
+
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+/* Write a block-sized buffer to the given block. Returns whether it worked. */
+int write_block(int fd, uint64_t block, const void *buf)
+{
+	return pwrite(fd, buf, PFS_BLOCK_SIZE,
+		(off_t) block * PFS_BLOCK_SIZE) == PFS_BLOCK_SIZE;
+}
+
+int write_zero_blocks(int fd, uint64_t block, uint64_t count)
+{
+	const char zeroes[PFS_BLOCK_SIZE] = { 0 };
+
+	while (count--)
+		if (!write_block(fd, block++, zeroes))
+			return 0;
+	return 1;
+}
+
+/* Fill a one-block bitmap whose first used bits are set. Bits from valid
+ * onwards do not track anything and are set too.
+ */
+void bitmap_fill(uint32_t *bitmap, uint64_t used, uint64_t valid)
+{
+	uint64_t k;
+
+	memset(bitmap, 0, PFS_BLOCK_SIZE);
+	for (k = 0; k < PFS_BITS_PER_BLOCK; k++)
+		if (k < used || k >= valid)
+			SETBIT(bitmap, k);
 }
 
 int main(int argc, char *argv[])
 {
-	int fd;
-	ssize_t ret;
+	int fd, opt, ok;
+	off_t dev_size;
+	uint64_t bytes_per_inode = DEFAULT_BYTES_PER_INODE;
+	uint64_t group, group_start, group_blocks, meta, used, root_block;
+	uint64_t last;
+	uint64_t features = PANTRYFS_FEATURE_DIR_INDEX;
 	struct pantryfs_super_block sb;
-	struct pantryfs_inode inode;
-	struct pantryfs_dir_entry dentry;
+	struct pantryfs_group_desc *gdt, *gd;
+	struct pantryfs_inode *inodes;
 
 	char *hello_contents = "Hello world!\n";
 	char buf[PFS_BLOCK_SIZE];
+	uint32_t bitmap[PFS_BLOCK_SIZE / sizeof(uint32_t)];
 
-	size_t len;
-	const char zeroes[PFS_BLOCK_SIZE] = { 0 };
+	while ((opt = getopt(argc, argv, "i:l")) != -1) {
+		switch (opt) {
+		case 'i':
+			bytes_per_inode = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			features &= ~PANTRYFS_FEATURE_DIR_INDEX;
+			break;
+		default:
+			bytes_per_inode = 0;
+		}
+	}
 
-	if (argc != 2) {
-		printf("Usage: ./format_disk_as_pantryfs DEVICE_NAME.\n");
+	if (argc - optind != 1 || !bytes_per_inode) {
+		printf("Usage: ./format_disk_as_pantryfs [-i BYTES_PER_INODE] [-l] DEVICE_NAME.\n");
 		return -1;
 	}
 
-	fd = open(argv[1], O_RDWR);
+	fd = open(argv[optind], O_RDWR);
 	if (fd == -1) {
 		perror("Error opening the device");
 		return -1;
 	}
+
+	dev_size = lseek(fd, 0, SEEK_END);
+	passert(dev_size >= 0, "Get device size");
+
 	memset(&sb, 0, sizeof(sb));
 
 	sb.version = 1;
 	sb.magic = PANTRYFS_MAGIC_NUMBER;
+	sb.features = features;
 
-	/* The first two inodes and datablocks are taken by the root and
-	 * hello.txt file, respectively. Mark them as such.
+	sb.blocks_count = dev_size / PFS_BLOCK_SIZE;
+	sb.blocks_per_group = PFS_BITS_PER_BLOCK;
+
+	/* Every group gets the same number of inodes, sized from the bytes in
+	 * a full group (or the whole device, if smaller), rounding up so that
+	 * the last inode table block is fully used.
 	 */
-	SETBIT(sb.free_inodes, 0);
-	SETBIT(sb.free_inodes, 1);
+	group_blocks = sb.blocks_count < sb.blocks_per_group ?
+		sb.blocks_count : sb.blocks_per_group;
+	sb.inodes_per_group = group_blocks * PFS_BLOCK_SIZE / bytes_per_inode;
+	if (!sb.inodes_per_group)
+		sb.inodes_per_group = 1;
+	if (sb.inodes_per_group > PFS_BITS_PER_BLOCK)
+		sb.inodes_per_group = PFS_BITS_PER_BLOCK;
+	sb.inode_table_blocks = DIV_ROUND_UP(sb.inodes_per_group,
+		PFS_INODES_PER_BLOCK);
+	sb.inodes_per_group = sb.inode_table_blocks * PFS_INODES_PER_BLOCK;
 
-	SETBIT(sb.free_data_blocks, 0);
-	SETBIT(sb.free_data_blocks, 1);
+	/* Leave out a last group too small for its metadata and some data. */
+	sb.groups_count = DIV_ROUND_UP(sb.blocks_count, sb.blocks_per_group);
+	last = sb.blocks_count - (sb.groups_count - 1) * sb.blocks_per_group;
+	if (sb.groups_count > 1 && last < 3 + sb.inode_table_blocks) {
+		sb.blocks_count -= last;
+		sb.groups_count--;
+	}
+	sb.gdt_blocks = DIV_ROUND_UP(sb.groups_count, PFS_DESC_PER_BLOCK);
+	sb.inodes_count = sb.groups_count * sb.inodes_per_group;
 
-	/* Write the superblock to the first block of the filesystem. */
-	ret = write(fd, (char *)&sb, sizeof(sb));
-	passert(ret == PFS_BLOCK_SIZE, "Write superblock");
+	/* Group 0 also holds the superblock, the descriptor table and the
+	 * root directory's block.
+	 */
+	root_block = 1 + sb.gdt_blocks + 2 + sb.inode_table_blocks;
+	passert(sb.groups_count && root_block < group_blocks,
+		"Device is large enough");
+
+	gdt = calloc(sb.gdt_blocks, PFS_BLOCK_SIZE);
+	passert(gdt != NULL, "Allocate group descriptor table");
+
+	/* The first two inodes are taken by the root and hello.txt file,
+	 * respectively. The root directory takes the first data block, while
+	 * hello.txt is small enough to live in its inode. Mark them, and the
+	 * metadata blocks of every group, as such.
+	 */
+	ok = 1;
+	for (group = 0; group < sb.groups_count && ok; group++) {
+		group_start = group * sb.blocks_per_group;
+		group_blocks = sb.blocks_count - group_start;
+		if (group_blocks > sb.blocks_per_group)
+			group_blocks = sb.blocks_per_group;
+		meta = group ? group_start : 1 + sb.gdt_blocks;
 
-	inode_reset(&inode);
-	inode.mode = S_IFDIR | 0777;
-	inode.nlink = 2;
-	inode.data_block_number = PANTRYFS_ROOT_DATABLOCK_NUMBER;
-	inode.file_size = PFS_BLOCK_SIZE;
+		gd = &gdt[group];
+		gd->block_bitmap = meta;
+		gd->inode_bitmap = meta + 1;
+		gd->inode_table = meta + 2;
 
-	/* Write the root inode starting in the second block. */
-	ret = write(fd, (char *)&inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write root inode");
+		used = gd->inode_table + sb.inode_table_blocks - group_start;
+		if (!group)
+			used++;
+		gd->free_blocks_count = group_blocks - used;
+		sb.free_blocks_count += gd->free_blocks_count;
+		bitmap_fill(bitmap, used, group_blocks);
+		ok = write_block(fd, gd->block_bitmap, bitmap);
+
+		used = group ? 0 : 2;
+		gd->free_inodes_count = sb.inodes_per_group - used;
+		sb.free_inodes_count += gd->free_inodes_count;
+		gd->used_dirs_count = group ? 0 : 1;
+		bitmap_fill(bitmap, used, sb.inodes_per_group);
+		ok = ok && write_block(fd, gd->inode_bitmap, bitmap);
+
+		ok = ok && write_zero_blocks(fd, gd->inode_table,
+			sb.inode_table_blocks);
+	}
+	passert(ok, "Write bitmaps and clear inode tables");
 
-	/* The hello.txt file will take inode num following root inode num. */
-	inode_reset(&inode);
-	inode.nlink = 1;
-	inode.mode = S_IFREG | 0666;
-	inode.data_block_number = PANTRYFS_ROOT_DATABLOCK_NUMBER + 1;
-	inode.file_size = strlen(hello_contents);
+	for (group = 0; group < sb.gdt_blocks && ok; group++)
+		ok = write_block(fd, PANTRYFS_GDT_DATABLOCK_NUMBER + group,
+			(char *) gdt + group * PFS_BLOCK_SIZE);
+	passert(ok, "Write group descriptor table");
 
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write hello.txt inode");
+	ok = write_block(fd, PANTRYFS_SUPERBLOCK_DATABLOCK_NUMBER, &sb);
+	passert(ok, "Write superblock");
 
-	ret = lseek(fd, PFS_BLOCK_SIZE - 2 * sizeof(struct pantryfs_inode),
-		SEEK_CUR);
-	passert(ret >= 0, "Seek past inode table");
+	/* The root and hello.txt inodes start the inode table of group 0. */
+	memset(buf, 0, sizeof(buf));
+	inodes = (struct pantryfs_inode *) buf;
 
-	dentry_reset(&dentry);
-	strncpy(dentry.filename, "hello.txt", sizeof(dentry.filename));
-	dentry.active = 1;
-	dentry.inode_no = PANTRYFS_ROOT_INODE_NUMBER + 1;
+	inode_reset(&inodes[0]);
+	inodes[0].mode = S_IFDIR | 0777;
+	inodes[0].nlink = 2;
+	inode_map_block(&inodes[0], root_block);
+	inodes[0].file_size = PFS_BLOCK_SIZE;
 
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for hello.txt");
+	inode_reset(&inodes[1]);
+	inodes[1].nlink = 1;
+	inodes[1].mode = S_IFREG | 0666;
+	inodes[1].flags = PANTRYFS_INLINE_DATA_FL;
+	inodes[1].file_size = strlen(hello_contents);
+	memcpy(inodes[1].inline_data, hello_contents, inodes[1].file_size);
 
-	len = PFS_BLOCK_SIZE - sizeof(struct pantryfs_dir_entry);
-	ret = write(fd, zeroes, len);
-	passert(ret == len, "Pad to end of root dentries");
+	ok = write_block(fd, gdt[0].inode_table, buf);
+	passert(ok, "Write root and hello.txt inodes");
 
-	strncpy(buf, hello_contents, sizeof(buf));
-	ret = write(fd, buf, sizeof(buf));
-	passert(ret == sizeof(buf), "Write hello.txt contents");
+	dir_block_init(buf, "hello.txt", PANTRYFS_ROOT_INODE_NUMBER + 1,
+		1 /* FT_REG_FILE */);
+	ok = write_block(fd, root_block, buf);
+	passert(ok, "Write dentry for hello.txt");
 
-	ret = fsync(fd);
-	passert(ret == 0, "Flush writes to disk");
+	ok = fsync(fd) == 0;
+	passert(ok, "Flush writes to disk");
 
+	free(gdt);
 	close(fd);
-	printf("Device [%s] formatted successfully.\n", argv[1]);
+	printf("Device [%s] formatted successfully with %llu groups and %llu inodes.\n",
+		argv[optind], (unsigned long long) sb.groups_count,
+		(unsigned long long) sb.inodes_count);
 
 	return 0;
 }
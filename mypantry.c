@@ -1,8 +1,21 @@
+#include <linux/bio.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
+#include <linux/fs_types.h>
 #include <linux/init.h>
+#include <linux/iversion.h>
+#include <linux/jhash.h>
 #include <linux/module.h>
+#include <linux/mpage.h>
+#include <linux/pagemap.h>
+#include <linux/random.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/statfs.h>
+#include <linux/sort.h>
+#include <linux/uaccess.h>
 
 #include "pantryfs_inode.h"
 #include "pantryfs_inode_ops.h"
@@ -11,98 +24,4432 @@
 #include "pantryfs_sb.h"
 #include "pantryfs_sb_ops.h"
 
-int pantryfs_iterate(struct file *filp, struct dir_context *ctx)
+/* Files at least this big are assumed to be streamed; see pantryfs_open(). */
+#define PANTRYFS_STREAM_MIN_SIZE (8 << 20)
+
+static unsigned int stream_ra_kb;
+module_param(stream_ra_kb, uint, 0644);
+MODULE_PARM_DESC(stream_ra_kb,
+	"Minimum readahead window for files of 8 MiB or more, in KiB (default 0: leave read_ahead_kb alone)");
+
+static inline struct pantryfs_sb_buffer_heads *PFS_SB(struct super_block *sb)
+{
+	return sb->s_fs_info;
+}
+
+static inline struct pantryfs_super_block *PFS_DISK_SB(struct super_block *sb)
+{
+	return (struct pantryfs_super_block *) PFS_SB(sb)->sb_bh->b_data;
+}
+
+static struct kmem_cache *pantryfs_inode_cachep;
+
+static inline struct pantryfs_inode_info *PFS_I(struct inode *inode)
+{
+	return container_of(inode, struct pantryfs_inode_info, vfs_inode);
+}
+
+static inline struct pantryfs_inode *PFS_INODE(struct inode *inode)
+{
+	return &PFS_I(inode)->pfs;
+}
+
+static inline bool pantryfs_has_inline_data(struct inode *inode)
+{
+	return PFS_INODE(inode)->flags & PANTRYFS_INLINE_DATA_FL;
+}
+
+/* Descriptor of block group @group. *@bh, if given, is set to the block of
+ * the in-memory descriptor table holding it, to be dirtied on changes.
+ */
+static struct pantryfs_group_desc *pantryfs_group_desc(struct super_block *sb,
+		unsigned long group, struct buffer_head **bh)
+{
+	struct buffer_head *gdt_bh = PFS_SB(sb)->gdt_bh[group / PFS_DESC_PER_BLOCK];
+
+	if (bh)
+		*bh = gdt_bh;
+	return (struct pantryfs_group_desc *) gdt_bh->b_data +
+		group % PFS_DESC_PER_BLOCK;
+}
+
+/* Number of blocks in group @group, which is only short for the last one. */
+static unsigned long pantryfs_group_blocks(struct super_block *sb,
+		unsigned long group)
+{
+	struct pantryfs_super_block *pfs_sb = PFS_DISK_SB(sb);
+
+	return min_t(uint64_t, pfs_sb->blocks_per_group,
+		pfs_sb->blocks_count - group * pfs_sb->blocks_per_group);
+}
+
+static inline unsigned long pantryfs_ino_group(struct super_block *sb,
+		unsigned long ino)
+{
+	return (ino - 1) / PFS_DISK_SB(sb)->inodes_per_group;
+}
+
+/* Device block holding inode @ino. *@slot is set to its index in that block. */
+static uint64_t pantryfs_inode_block(struct super_block *sb, unsigned long ino,
+		unsigned int *slot)
+{
+	unsigned long index = (ino - 1) % PFS_DISK_SB(sb)->inodes_per_group;
+
+	*slot = index % PFS_INODES_PER_BLOCK;
+	return pantryfs_group_desc(sb, pantryfs_ino_group(sb, ino), NULL)->inode_table +
+		index / PFS_INODES_PER_BLOCK;
+}
+
+/* Where to start looking for the first data block of @inode: its own group. */
+static uint64_t pantryfs_inode_goal(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+
+	return pantryfs_ino_group(sb, inode->i_ino) *
+		PFS_DISK_SB(sb)->blocks_per_group;
+}
+
+/* Claim up to @max free blocks of @group from block @first of the group on.
+ * Returns the number of contiguous blocks claimed, 0 if there are none
+ * free, or -EIO.
+ */
+static int pantryfs_group_alloc_blocks(struct super_block *sb,
+		unsigned long group, unsigned long first, unsigned int max,
+		uint64_t *start)
+{
+	struct pantryfs_group_info *gi = &PFS_SB(sb)->groups[group];
+	struct pantryfs_group_desc *gd;
+	struct buffer_head *gd_bh, *bh;
+	unsigned long limit, found, run_end, i;
+	int ret = 0;
+
+	gd = pantryfs_group_desc(sb, group, &gd_bh);
+	if (!gd->free_blocks_count)
+		return 0;
+
+	mutex_lock(&gi->lock);
+	bh = sb_bread(sb, gd->block_bitmap);
+	if (!bh) {
+		ret = -EIO;
+		goto out_unlock;
+	}
+
+	limit = pantryfs_group_blocks(sb, group);
+	found = find_next_zero_bit_le(bh->b_data, limit,
+		max(first, gi->block_hint));
+	if (first <= gi->block_hint)
+		gi->block_hint = found;
+	if (found < limit) {
+		run_end = find_next_bit_le(bh->b_data,
+			min_t(unsigned long, limit, found + max), found);
+		for (i = found; i < run_end; i++)
+			__set_bit_le(i, bh->b_data);
+		mark_buffer_dirty(bh);
+		if (gi->block_hint == found)
+			gi->block_hint = run_end;
+
+		gd->free_blocks_count -= run_end - found;
+		mark_buffer_dirty(gd_bh);
+		percpu_counter_sub(&PFS_SB(sb)->free_blocks, run_end - found);
+
+		*start = group * PFS_DISK_SB(sb)->blocks_per_group + found;
+		ret = run_end - found;
+	}
+	brelse(bh);
+out_unlock:
+	mutex_unlock(&gi->lock);
+	return ret;
+}
+
+/**
+ * Grab up to @max free data blocks, preferring a run that starts at @goal.
+ * Returns the number of contiguous blocks allocated starting at *@start,
+ * -ENOSPC or -EIO.
+ *
+ * The search starts at @goal in its block group, moves on through the
+ * following groups and wraps around, finishing with the part of the goal's
+ * group in front of @goal.
+ *
+ * @sb:		The pantryfs superblock.
+ * @goal:	Device block the caller would like the run to start at.
+ * @max:	Upper bound on the number of blocks to allocate.
+ * @start:	Set to the first device block of the allocated run.
+ */
+static int pantryfs_alloc_blocks(struct super_block *sb, uint64_t goal,
+		unsigned int max, uint64_t *start)
+{
+	struct pantryfs_super_block *pfs_sb = PFS_DISK_SB(sb);
+	unsigned long ngroups = pfs_sb->groups_count, group, i;
+	int ret;
+
+	if (goal >= pfs_sb->blocks_count)
+		goal = 0;
+	group = goal / pfs_sb->blocks_per_group;
+
+	for (i = 0; i <= ngroups; i++, group = (group + 1) % ngroups) {
+		ret = pantryfs_group_alloc_blocks(sb, group,
+			i ? 0 : goal % pfs_sb->blocks_per_group, max, start);
+		if (ret)
+			return ret;
+	}
+
+	return -ENOSPC;
+}
+
+static void pantryfs_free_blocks(struct super_block *sb, uint64_t start,
+		unsigned int count)
+{
+	struct pantryfs_super_block *pfs_sb = PFS_DISK_SB(sb);
+	struct pantryfs_group_desc *gd;
+	struct pantryfs_group_info *gi;
+	struct buffer_head *gd_bh, *bh;
+	unsigned long group, offset, nr, i;
+
+	while (count) {
+		group = start / pfs_sb->blocks_per_group;
+		offset = start % pfs_sb->blocks_per_group;
+		nr = min_t(unsigned long, count,
+			pfs_sb->blocks_per_group - offset);
+		gd = pantryfs_group_desc(sb, group, &gd_bh);
+		gi = &PFS_SB(sb)->groups[group];
+
+		mutex_lock(&gi->lock);
+		bh = sb_bread(sb, gd->block_bitmap);
+		if (!bh) {
+			mutex_unlock(&gi->lock);
+			pr_err("Pantryfs: leaking blocks %llu-%llu\n",
+				start, start + count - 1);
+			return;
+		}
+		for (i = 0; i < nr; i++)
+			__clear_bit_le(offset + i, bh->b_data);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+		gi->block_hint = min(gi->block_hint, offset);
+
+		gd->free_blocks_count += nr;
+		mark_buffer_dirty(gd_bh);
+		mutex_unlock(&gi->lock);
+		percpu_counter_add(&PFS_SB(sb)->free_blocks, nr);
+
+		start += nr;
+		count -= nr;
+	}
+}
+
+/* Free blocks held back from delayed allocation, so that writeback can still
+ * allocate the extent blocks it may need once reservations use up the rest.
+ */
+static s64 pantryfs_meta_reserve(struct super_block *sb)
+{
+	return clamp_t(u64, PFS_DISK_SB(sb)->blocks_count >> 7, 1, 1024);
+}
+
+/* Promise @nr free blocks to dirty pages that have no block yet. Fails with
+ * -ENOSPC once the free blocks not already promised run out.
+ */
+static int pantryfs_reserve_blocks(struct super_block *sb, s64 nr)
+{
+	struct pantryfs_sb_buffer_heads *sbh = PFS_SB(sb);
+	s64 need = nr + pantryfs_meta_reserve(sb);
+	s64 avail;
+
+	avail = percpu_counter_read_positive(&sbh->free_blocks) -
+		percpu_counter_read_positive(&sbh->dirty_blocks);
+	/* The cheap reads may be off by the per-CPU batches; sum when close. */
+	if (avail < need + 2 * percpu_counter_batch * num_online_cpus())
+		avail = percpu_counter_sum_positive(&sbh->free_blocks) -
+			percpu_counter_sum_positive(&sbh->dirty_blocks);
+	if (avail < need)
+		return -ENOSPC;
+
+	percpu_counter_add(&sbh->dirty_blocks, nr);
+	return 0;
+}
+
+/* Drop @nr reservations, once allocated or no longer needed. */
+static void pantryfs_release_blocks(struct super_block *sb, s64 nr)
+{
+	if (nr)
+		percpu_counter_sub(&PFS_SB(sb)->dirty_blocks, nr);
+}
+
+/* A file's extent map. Only the index and the leaf being worked on are read
+ * in; the other leaves stay on disk.
+ */
+struct pantryfs_extent_map {
+	struct inode *inode;
+	struct pantryfs_inode *pfs_inode;
+	struct buffer_head *index_bh;	/* With PANTRYFS_EXT_INDEX_FL */
+	struct buffer_head *leaf_bh;	/* Last leaf read in, or NULL */
+	int leaf;			/* Its position in the index */
+	int node;			/* Leaf worked on, or -1 for the inode */
+	struct pantryfs_extent *ext;	/* Extents of that node */
+};
+
+/* Read overflow block @block of @map, checking it belongs to the file. */
+static struct buffer_head *pantryfs_ext_read(struct pantryfs_extent_map *map,
+		uint64_t block, uint32_t magic)
+{
+	struct inode *inode = map->inode;
+	struct pantryfs_extent_block *eb;
+	struct buffer_head *bh;
+
+	bh = sb_bread(inode->i_sb, block);
+	if (!bh)
+		return ERR_PTR(-EIO);
+
+	/* Index blocks share the header layout of extent blocks. */
+	eb = (struct pantryfs_extent_block *) bh->b_data;
+	if (eb->magic != magic || eb->owner != inode->i_ino) {
+		pr_err("Pantryfs: bad extent block %llu for inode %lu\n",
+			block, inode->i_ino);
+		brelse(bh);
+		return ERR_PTR(-EIO);
+	}
+	return bh;
+}
+
+static struct pantryfs_extent_block *pantryfs_ext_block(struct buffer_head *bh)
+{
+	return (struct pantryfs_extent_block *) bh->b_data;
+}
+
+static struct pantryfs_extent_index *pantryfs_ext_index(
+		struct pantryfs_extent_map *map)
+{
+	return (struct pantryfs_extent_index *) map->index_bh->b_data;
+}
+
+static void pantryfs_ext_release(struct pantryfs_extent_map *map)
+{
+	brelse(map->leaf_bh);
+	brelse(map->index_bh);
+}
+
+static int pantryfs_ext_load(struct inode *inode, struct pantryfs_extent_map *map)
+{
+	struct pantryfs_inode *pfs_inode = PFS_INODE(inode);
+	struct pantryfs_extent_index *ei;
+	struct buffer_head *bh;
+
+	map->inode = inode;
+	map->pfs_inode = pfs_inode;
+	map->index_bh = NULL;
+	map->leaf_bh = NULL;
+	map->leaf = -1;
+	map->node = -1;
+	map->ext = pfs_inode->extents;
+
+	/* The extent map is overlaid by the data; see pantryfs_inline_spill. */
+	if (pfs_inode->flags & PANTRYFS_INLINE_DATA_FL)
+		return -EINVAL;
+
+	if (!(pfs_inode->flags & PANTRYFS_EXT_INDEX_FL))
+		return 0;
+
+	bh = pantryfs_ext_read(map, pfs_inode->ext_block,
+		PANTRYFS_EXTENT_INDEX_MAGIC);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	ei = (struct pantryfs_extent_index *) bh->b_data;
+	if (!ei->count || ei->count > PANTRYFS_EXT_MAX_LEAVES) {
+		pr_err("Pantryfs: bad extent index %llu for inode %lu\n",
+			pfs_inode->ext_block, inode->i_ino);
+		brelse(bh);
+		return -EIO;
+	}
+	map->index_bh = bh;
+	return 0;
+}
+
+static int pantryfs_ext_nr_leaves(struct pantryfs_extent_map *map)
+{
+	if (map->index_bh)
+		return pantryfs_ext_index(map)->count;
+	return map->pfs_inode->ext_block ? 1 : 0;
+}
+
+/* Number of extents in the node being worked on. */
+static int pantryfs_ext_nr(struct pantryfs_extent_map *map)
+{
+	if (map->node >= 0)
+		return pantryfs_ext_block(map->leaf_bh)->count;
+	return min_t(uint32_t, map->pfs_inode->ext_count,
+		PANTRYFS_INLINE_EXTENTS);
+}
+
+/* Make @bh, leaf @leaf, the one kept read in, taking over the reference. */
+static void pantryfs_ext_set_leaf(struct pantryfs_extent_map *map,
+		struct buffer_head *bh, int leaf)
+{
+	if (map->leaf_bh != bh)
+		brelse(map->leaf_bh);
+	map->leaf_bh = bh;
+	map->leaf = bh ? leaf : -1;
+}
+
+/* Read leaf @leaf in, unless it already is. */
+static int pantryfs_ext_read_leaf(struct pantryfs_extent_map *map, int leaf)
+{
+	uint64_t block = map->pfs_inode->ext_block;
+	struct pantryfs_extent_block *eb;
+	struct buffer_head *bh;
+
+	if (leaf == map->leaf)
+		return 0;
+
+	if (map->index_bh)
+		block = pantryfs_ext_index(map)->entries[leaf].block;
+	bh = pantryfs_ext_read(map, block, PANTRYFS_EXTENT_MAGIC);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	eb = pantryfs_ext_block(bh);
+	if (!eb->count || eb->count > PANTRYFS_EXTENTS_PER_BLOCK) {
+		pr_err("Pantryfs: bad extent block %llu for inode %lu\n",
+			block, map->inode->i_ino);
+		brelse(bh);
+		return -EIO;
+	}
+	pantryfs_ext_set_leaf(map, bh, leaf);
+	return 0;
+}
+
+/* Work on leaf @node, or on the inode's extents if @node is -1. */
+static int pantryfs_ext_load_node(struct pantryfs_extent_map *map, int node)
+{
+	int ret;
+
+	if (node < 0) {
+		map->node = -1;
+		map->ext = map->pfs_inode->extents;
+		return 0;
+	}
+
+	ret = pantryfs_ext_read_leaf(map, node);
+	if (ret)
+		return ret;
+	map->node = node;
+	map->ext = pantryfs_ext_block(map->leaf_bh)->extents;
+	return 0;
+}
+
+/**
+ * Work on the node holding the last extent that starts at or before @lblk,
+ * and set *@slot to that extent's slot in it, or to -1 if there is none.
+ * Only that node's leaf is read, found by a binary search of the index.
+ */
+static int pantryfs_ext_seek(struct pantryfs_extent_map *map, uint32_t lblk,
+		int *slot)
+{
+	struct pantryfs_inode *pfs_inode = map->pfs_inode;
+	struct pantryfs_extent_index *ei;
+	int node = -1, lo, hi, mid, ret;
+
+	if (map->index_bh) {
+		ei = pantryfs_ext_index(map);
+		lo = 0;
+		hi = (int) ei->count - 1;
+		while (lo <= hi) {
+			mid = lo + (hi - lo) / 2;
+			if (ei->entries[mid].ee_block <= lblk)
+				lo = mid + 1;
+			else
+				hi = mid - 1;
+		}
+		node = hi;
+	} else if (pfs_inode->ext_block && lblk >
+		   pfs_inode->extents[PANTRYFS_INLINE_EXTENTS - 1].ee_block) {
+		/* A lone leaf has no index entry; its first extent tells. */
+		ret = pantryfs_ext_read_leaf(map, 0);
+		if (ret)
+			return ret;
+		if (pantryfs_ext_block(map->leaf_bh)->extents[0].ee_block <=
+		    lblk)
+			node = 0;
+	}
+
+	ret = pantryfs_ext_load_node(map, node);
+	if (ret)
+		return ret;
+
+	lo = 0;
+	hi = pantryfs_ext_nr(map) - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (map->ext[mid].ee_block <= lblk)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	*slot = hi;
+	return 0;
+}
+
+/* Set *@start to the logical block at which the extent after @slot of the
+ * node being worked on starts, or to U32_MAX + 1 if there is none.
+ */
+static int pantryfs_ext_next_start(struct pantryfs_extent_map *map, int slot,
+		uint64_t *start)
+{
+	int ret;
+
+	*start = (uint64_t) U32_MAX + 1;
+	if (slot + 1 < pantryfs_ext_nr(map)) {
+		*start = map->ext[slot + 1].ee_block;
+		return 0;
+	}
+	if (map->node + 1 >= pantryfs_ext_nr_leaves(map))
+		return 0;
+	if (map->index_bh) {
+		*start = pantryfs_ext_index(map)->entries[map->node + 1].ee_block;
+		return 0;
+	}
+
+	ret = pantryfs_ext_read_leaf(map, 0);
+	if (!ret)
+		*start = pantryfs_ext_block(map->leaf_bh)->extents[0].ee_block;
+	return ret;
+}
+
+/* Move *@slot on to the next extent, into the next node if need be. Returns
+ * 1 if there is none.
+ */
+static int pantryfs_ext_step(struct pantryfs_extent_map *map, int *slot)
+{
+	if (*slot + 1 < pantryfs_ext_nr(map)) {
+		(*slot)++;
+		return 0;
+	}
+	if (map->node + 1 >= pantryfs_ext_nr_leaves(map))
+		return 1;
+
+	*slot = 0;
+	return pantryfs_ext_load_node(map, map->node + 1);
+}
+
+static uint32_t pantryfs_ext_len(const struct pantryfs_extent *ext)
+{
+	return ext->ee_len & PANTRYFS_EXT_MAX_LEN;
+}
+
+static bool pantryfs_ext_unwritten(const struct pantryfs_extent *ext)
+{
+	return ext->ee_len & PANTRYFS_EXT_UNWRITTEN;
+}
+
+/* Logical block just past the end of @ext. */
+static uint64_t pantryfs_ext_end(const struct pantryfs_extent *ext)
+{
+	return (uint64_t) ext->ee_block + pantryfs_ext_len(ext);
+}
+
+/* Set the length of @ext, keeping its state. */
+static void pantryfs_ext_set_len(struct pantryfs_extent *ext, uint32_t len)
+{
+	ext->ee_len = (ext->ee_len & PANTRYFS_EXT_UNWRITTEN) | len;
+}
+
+/* Whether @b carries on from @a, on disk as well as in the file. */
+static bool pantryfs_ext_mergeable(const struct pantryfs_extent *a,
+		const struct pantryfs_extent *b)
+{
+	return pantryfs_ext_unwritten(a) == pantryfs_ext_unwritten(b) &&
+	       pantryfs_ext_end(a) == b->ee_block &&
+	       a->ee_start + pantryfs_ext_len(a) == b->ee_start &&
+	       (uint64_t) pantryfs_ext_len(a) + pantryfs_ext_len(b) <=
+			PANTRYFS_EXT_MAX_LEN;
+}
+
+/* Record that extent @slot of the node being worked on changed, so that the
+ * node makes it back to disk. A leaf's first extent is also its index key.
+ */
+static void pantryfs_ext_dirty(struct pantryfs_extent_map *map, int slot)
+{
+	struct pantryfs_extent_index *ei;
+
+	if (map->node >= 0) {
+		mark_buffer_dirty_inode(map->leaf_bh, map->inode);
+		if (!slot && map->index_bh) {
+			ei = pantryfs_ext_index(map);
+			ei->entries[map->node].ee_block = map->ext[0].ee_block;
+			mark_buffer_dirty_inode(map->index_bh, map->inode);
+		}
+	}
+	mark_inode_dirty(map->inode);
+}
+
+/* Get a zeroed block near @goal for the extent map, with header @magic. */
+static struct buffer_head *pantryfs_ext_new_block(
+		struct pantryfs_extent_map *map, uint64_t goal, uint32_t magic)
+{
+	struct super_block *sb = map->inode->i_sb;
+	struct pantryfs_extent_block *eb;
+	struct buffer_head *bh;
+	uint64_t block;
+	int ret;
+
+	ret = pantryfs_alloc_blocks(sb, goal, 1, &block);
+	if (ret < 0)
+		return ERR_PTR(ret);
+
+	bh = sb_getblk(sb, block);
+	if (!bh) {
+		pantryfs_free_blocks(sb, block, 1);
+		return ERR_PTR(-ENOMEM);
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, PFS_BLOCK_SIZE);
+	eb = (struct pantryfs_extent_block *) bh->b_data;
+	eb->magic = magic;
+	eb->owner = map->inode->i_ino;
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, map->inode);
+
+	map->inode->i_blocks += PFS_BLOCK_SIZE >> 9;
+	return bh;
+}
+
+static void pantryfs_ext_free_block(struct pantryfs_extent_map *map,
+		struct buffer_head *bh)
+{
+	uint64_t block = bh->b_blocknr;
+
+	bforget(bh);
+	pantryfs_free_blocks(map->inode->i_sb, block, 1);
+	map->inode->i_blocks -= PFS_BLOCK_SIZE >> 9;
+}
+
+/* Give the lone leaf an index, listing it under @key, so that it can have
+ * siblings.
+ */
+static int pantryfs_ext_make_index(struct pantryfs_extent_map *map,
+		uint32_t key)
+{
+	struct pantryfs_inode *pfs_inode = map->pfs_inode;
+	struct pantryfs_extent_index *ei;
+	struct buffer_head *bh;
+
+	bh = pantryfs_ext_new_block(map, pfs_inode->ext_block + 1,
+		PANTRYFS_EXTENT_INDEX_MAGIC);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	ei = (struct pantryfs_extent_index *) bh->b_data;
+	ei->entries[0].ee_block = key;
+	ei->entries[0].block = pfs_inode->ext_block;
+	ei->count = 1;
+	map->index_bh = bh;
+	pfs_inode->ext_block = bh->b_blocknr;
+	pfs_inode->flags |= PANTRYFS_EXT_INDEX_FL;
+	mark_inode_dirty(map->inode);
+	return 0;
+}
+
+/* Drop leaf @leaf from the index, which goes once a single leaf is left. The
+ * leaf must not be the one read in.
+ */
+static void pantryfs_ext_index_remove(struct pantryfs_extent_map *map,
+		int leaf)
+{
+	struct pantryfs_inode *pfs_inode = map->pfs_inode;
+	struct pantryfs_extent_index *ei = pantryfs_ext_index(map);
+
+	memmove(&ei->entries[leaf], &ei->entries[leaf + 1],
+		(ei->count - leaf - 1) * sizeof(ei->entries[0]));
+	ei->count--;
+	mark_buffer_dirty_inode(map->index_bh, map->inode);
+	if (map->leaf > leaf)
+		map->leaf--;
+
+	if (ei->count <= 1) {
+		pfs_inode->ext_block = ei->count ? ei->entries[0].block : 0;
+		pfs_inode->flags &= ~PANTRYFS_EXT_INDEX_FL;
+		pantryfs_ext_free_block(map, map->index_bh);
+		map->index_bh = NULL;
+	}
+	mark_inode_dirty(map->inode);
+}
+
+/* Split the full leaf being worked on, moving its upper half to a new leaf
+ * right after it; an append moves nothing and starts the new leaf instead.
+ * Afterwards the node worked on is the half that *@slot falls into, and
+ * *@slot is its slot there.
+ */
+static int pantryfs_ext_split_leaf(struct pantryfs_extent_map *map, int *slot)
+{
+	struct pantryfs_extent_block *eb = pantryfs_ext_block(map->leaf_bh);
+	struct pantryfs_extent_block *neb;
+	struct pantryfs_extent_index *ei;
+	int keep = eb->count / 2, leaf = map->node + 1, ret;
+	struct buffer_head *bh;
+
+	if (pantryfs_ext_nr_leaves(map) >= PANTRYFS_EXT_MAX_LEAVES)
+		return -EFBIG;
+	if (*slot == eb->count)
+		keep = eb->count;
+
+	bh = pantryfs_ext_new_block(map, map->leaf_bh->b_blocknr + 1,
+		PANTRYFS_EXTENT_MAGIC);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	if (!map->index_bh) {
+		ret = pantryfs_ext_make_index(map, eb->extents[0].ee_block);
+		if (ret) {
+			pantryfs_ext_free_block(map, bh);
+			return ret;
+		}
+	}
+
+	neb = pantryfs_ext_block(bh);
+	neb->count = eb->count - keep;
+	memcpy(neb->extents, &eb->extents[keep],
+		neb->count * sizeof(neb->extents[0]));
+	eb->count = keep;
+	mark_buffer_dirty_inode(map->leaf_bh, map->inode);
+
+	/* An empty new leaf gets its key from the extent inserted into it. */
+	ei = pantryfs_ext_index(map);
+	memmove(&ei->entries[leaf + 1], &ei->entries[leaf],
+		(ei->count - leaf) * sizeof(ei->entries[0]));
+	ei->entries[leaf].ee_block = neb->count ? neb->extents[0].ee_block :
+		U32_MAX;
+	ei->entries[leaf].block = bh->b_blocknr;
+	ei->count++;
+	mark_buffer_dirty_inode(map->index_bh, map->inode);
+
+	if (*slot < keep) {
+		brelse(bh);
+		return 0;
+	}
+	*slot -= keep;
+	pantryfs_ext_set_leaf(map, bh, leaf);
+	return pantryfs_ext_load_node(map, leaf);
+}
+
+static int pantryfs_ext_leaf_insert(struct pantryfs_extent_map *map, int slot,
+		const struct pantryfs_extent *ext)
+{
+	struct pantryfs_extent_block *eb = pantryfs_ext_block(map->leaf_bh);
+	int ret;
+
+	if (eb->count == PANTRYFS_EXTENTS_PER_BLOCK) {
+		ret = pantryfs_ext_split_leaf(map, &slot);
+		if (ret)
+			return ret;
+		eb = pantryfs_ext_block(map->leaf_bh);
+	}
+
+	memmove(&eb->extents[slot + 1], &eb->extents[slot],
+		(eb->count - slot) * sizeof(eb->extents[0]));
+	eb->extents[slot] = *ext;
+	eb->count++;
+	map->pfs_inode->ext_count++;
+	pantryfs_ext_dirty(map, slot);
+	return 0;
+}
+
+/* Insert @ext at @slot of the node being worked on, changing nothing if that
+ * fails. A full inode hands its last extent on to the first leaf.
+ */
+static int pantryfs_ext_insert(struct pantryfs_extent_map *map, int slot,
+		const struct pantryfs_extent *ext)
+{
+	struct pantryfs_inode *pfs_inode = map->pfs_inode;
+	struct pantryfs_extent *extents = pfs_inode->extents, last;
+	int nr = pantryfs_ext_nr(map), ret = 0;
+	struct buffer_head *bh;
+
+	if (map->node >= 0)
+		return pantryfs_ext_leaf_insert(map, slot, ext);
+
+	if (nr < PANTRYFS_INLINE_EXTENTS) {
+		memmove(&extents[slot + 1], &extents[slot],
+			(nr - slot) * sizeof(*extents));
+		extents[slot] = *ext;
+		pfs_inode->ext_count++;
+		mark_inode_dirty(map->inode);
+		return 0;
+	}
+
+	last = slot < nr ? extents[nr - 1] : *ext;
+	if (!pfs_inode->ext_block) {
+		bh = pantryfs_ext_new_block(map,
+			last.ee_start + pantryfs_ext_len(&last),
+			PANTRYFS_EXTENT_MAGIC);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		pfs_inode->ext_block = bh->b_blocknr;
+		pantryfs_ext_set_leaf(map, bh, 0);
+	}
+	ret = pantryfs_ext_load_node(map, 0);
+	if (!ret)
+		ret = pantryfs_ext_leaf_insert(map, 0, &last);
+	pantryfs_ext_load_node(map, -1);
+	if (ret || slot == nr)
+		return ret;
+
+	memmove(&extents[slot + 1], &extents[slot],
+		(nr - slot - 1) * sizeof(*extents));
+	extents[slot] = *ext;
+	mark_inode_dirty(map->inode);
+	return 0;
+}
+
+/* Free the emptied leaf being worked on, and work on the inode instead. */
+static void pantryfs_ext_drop_leaf(struct pantryfs_extent_map *map)
+{
+	struct buffer_head *bh = map->leaf_bh;
+	int leaf = map->leaf;
+
+	map->leaf_bh = NULL;
+	map->leaf = -1;
+	pantryfs_ext_free_block(map, bh);
+	if (map->index_bh)
+		pantryfs_ext_index_remove(map, leaf);
+	else
+		map->pfs_inode->ext_block = 0;
+	mark_inode_dirty(map->inode);
+	pantryfs_ext_load_node(map, -1);
+}
+
+/* Fold the leaf being worked on, which has run low, and a neighbour together
+ * if they fit in one with room to spare. The left one takes in the right.
+ */
+static void pantryfs_ext_merge_leaf(struct pantryfs_extent_map *map)
+{
+	struct pantryfs_extent_block *left, *right;
+	int leaf = map->node, other = leaf ? leaf - 1 : leaf + 1;
+	struct buffer_head *bh, *lbh, *rbh;
+
+	if (!map->index_bh || other >= pantryfs_ext_nr_leaves(map))
+		return;
+
+	/* Merging is only worth it; a neighbour that cannot be read stays. */
+	bh = pantryfs_ext_read(map, pantryfs_ext_index(map)->entries[other].block,
+		PANTRYFS_EXTENT_MAGIC);
+	if (IS_ERR(bh))
+		return;
+	lbh = other < leaf ? bh : map->leaf_bh;
+	rbh = other < leaf ? map->leaf_bh : bh;
+	left = pantryfs_ext_block(lbh);
+	right = pantryfs_ext_block(rbh);
+	if (left->count + right->count > PANTRYFS_EXTENTS_PER_BLOCK * 3 / 4) {
+		brelse(bh);
+		return;
+	}
+
+	memcpy(&left->extents[left->count], right->extents,
+		right->count * sizeof(right->extents[0]));
+	left->count += right->count;
+	mark_buffer_dirty_inode(lbh, map->inode);
+
+	map->leaf_bh = lbh;
+	map->leaf = min(leaf, other);
+	pantryfs_ext_free_block(map, rbh);
+	pantryfs_ext_index_remove(map, max(leaf, other));
+	pantryfs_ext_load_node(map, map->leaf);
+}
+
+static void pantryfs_ext_leaf_delete(struct pantryfs_extent_map *map, int slot)
+{
+	struct pantryfs_extent_block *eb = pantryfs_ext_block(map->leaf_bh);
+
+	eb->count--;
+	memmove(&eb->extents[slot], &eb->extents[slot + 1],
+		(eb->count - slot) * sizeof(eb->extents[0]));
+	map->pfs_inode->ext_count--;
+	if (!eb->count) {
+		pantryfs_ext_drop_leaf(map);
+		return;
+	}
+
+	pantryfs_ext_dirty(map, slot);
+	if (eb->count == PANTRYFS_EXTENTS_PER_BLOCK / 4)
+		pantryfs_ext_merge_leaf(map);
+}
+
+/* Remove extent @slot of the node being worked on. The inode makes up for
+ * the extent it loses with the first one of the first leaf.
+ */
+static int pantryfs_ext_delete(struct pantryfs_extent_map *map, int slot)
+{
+	struct pantryfs_inode *pfs_inode = map->pfs_inode;
+	struct pantryfs_extent *extents = pfs_inode->extents;
+	int nr = pantryfs_ext_nr(map), ret;
+
+	if (map->node >= 0) {
+		pantryfs_ext_leaf_delete(map, slot);
+		return 0;
+	}
+
+	/* Read the leaf before touching anything, so failing changes nothing. */
+	if (pfs_inode->ext_block) {
+		ret = pantryfs_ext_read_leaf(map, 0);
+		if (ret)
+			return ret;
+	}
+
+	memmove(&extents[slot], &extents[slot + 1],
+		(nr - slot - 1) * sizeof(*extents));
+	mark_inode_dirty(map->inode);
+	if (!pfs_inode->ext_block) {
+		pfs_inode->ext_count--;
+		return 0;
+	}
+
+	extents[nr - 1] = pantryfs_ext_block(map->leaf_bh)->extents[0];
+	pantryfs_ext_load_node(map, 0);
+	pantryfs_ext_leaf_delete(map, 0);
+	return 0;
+}
+
+/* Fold extent @slot + 1 of the node being worked on into extent @slot if it
+ * carries on from it.
+ */
+static void pantryfs_ext_merge_next(struct pantryfs_extent_map *map, int slot)
+{
+	struct pantryfs_extent *ext, *next;
+	uint32_t len;
+
+	if (slot < 0 || slot + 1 >= pantryfs_ext_nr(map))
+		return;
+
+	ext = &map->ext[slot];
+	next = &map->ext[slot + 1];
+	if (!pantryfs_ext_mergeable(ext, next))
+		return;
+
+	len = pantryfs_ext_len(ext);
+	pantryfs_ext_set_len(ext, len + pantryfs_ext_len(next));
+	pantryfs_ext_dirty(map, slot);
+	/* Only the inode's extents can fail to give one up, and stay put. */
+	if (pantryfs_ext_delete(map, slot + 1))
+		pantryfs_ext_set_len(ext, len);
+}
+
+/* Merge the extent holding @lblk with its neighbours in its node. */
+static void pantryfs_ext_merge_at(struct pantryfs_extent_map *map,
+		uint32_t lblk)
+{
+	int slot;
+
+	if (pantryfs_ext_seek(map, lblk, &slot))
+		return;
+	pantryfs_ext_merge_next(map, slot);
+	if (slot > 0 && !pantryfs_ext_seek(map, lblk, &slot))
+		pantryfs_ext_merge_next(map, slot - 1);
+}
+
+/* Add @ext right after extent @slot of the node being worked on, merging it
+ * with its neighbours there.
+ */
+static int pantryfs_ext_add(struct pantryfs_extent_map *map, int slot,
+		const struct pantryfs_extent *ext)
+{
+	struct pantryfs_extent *prev = NULL, *next = NULL;
+
+	if (slot >= 0)
+		prev = &map->ext[slot];
+	if (slot + 1 < pantryfs_ext_nr(map))
+		next = &map->ext[slot + 1];
+
+	if (prev && pantryfs_ext_mergeable(prev, ext)) {
+		pantryfs_ext_set_len(prev,
+			pantryfs_ext_len(prev) + pantryfs_ext_len(ext));
+		pantryfs_ext_dirty(map, slot);
+		pantryfs_ext_merge_next(map, slot);
+		return 0;
+	}
+
+	if (next && pantryfs_ext_mergeable(ext, next)) {
+		next->ee_block = ext->ee_block;
+		next->ee_start = ext->ee_start;
+		pantryfs_ext_set_len(next,
+			pantryfs_ext_len(ext) + pantryfs_ext_len(next));
+		pantryfs_ext_dirty(map, slot + 1);
+		return 0;
+	}
+
+	return pantryfs_ext_insert(map, slot + 1, ext);
+}
+
+/* Split extent @slot of the node being worked on in two at logical block
+ * @lblk, which must fall inside it but not at its start.
+ */
+static int pantryfs_ext_split(struct pantryfs_extent_map *map, int slot,
+		uint32_t lblk)
+{
+	struct pantryfs_extent *ext = &map->ext[slot], tail;
+	uint32_t head = lblk - ext->ee_block, len = pantryfs_ext_len(ext);
+	int ret;
+
+	tail = *ext;
+	tail.ee_block = lblk;
+	tail.ee_start += head;
+	pantryfs_ext_set_len(&tail, len - head);
+
+	pantryfs_ext_set_len(ext, head);
+	pantryfs_ext_dirty(map, slot);
+	ret = pantryfs_ext_insert(map, slot + 1, &tail);
+	if (ret)
+		pantryfs_ext_set_len(ext, len);
+	return ret;
+}
+
+/* Mark the allocated blocks of [@from, @end) unwritten, or written. */
+static int pantryfs_ext_set_state(struct pantryfs_extent_map *map,
+		uint32_t from, uint64_t end, bool unwritten)
+{
+	struct pantryfs_extent *ext;
+	uint64_t lblk = from;
+	int slot, ret;
+
+	while (lblk < end) {
+		ret = pantryfs_ext_seek(map, lblk, &slot);
+		if (ret)
+			return ret;
+
+		ext = slot >= 0 ? &map->ext[slot] : NULL;
+		if (!ext || pantryfs_ext_end(ext) <= lblk) {
+			ret = pantryfs_ext_next_start(map, slot, &lblk);
+			if (ret)
+				return ret;
+			continue;
+		}
+		if (pantryfs_ext_unwritten(ext) == unwritten) {
+			lblk = pantryfs_ext_end(ext);
+			continue;
+		}
+
+		/* Split off the parts outside the range, then look again. */
+		if (ext->ee_block < lblk || pantryfs_ext_end(ext) > end) {
+			ret = pantryfs_ext_split(map, slot,
+				ext->ee_block < lblk ? lblk : end);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		ext->ee_len ^= PANTRYFS_EXT_UNWRITTEN;
+		pantryfs_ext_dirty(map, slot);
+		lblk = pantryfs_ext_end(ext);
+		pantryfs_ext_merge_at(map, ext->ee_block);
+	}
+	return 0;
+}
+
+/* Free the blocks of [@from, @end) and drop them from the extent map, working
+ * back from @end. Only a range in the middle of an extent needs a new
+ * extent, and so can fail for want of space.
+ */
+static int pantryfs_ext_remove(struct pantryfs_extent_map *map, uint32_t from,
+		uint64_t end)
+{
+	struct super_block *sb = map->inode->i_sb;
+	struct pantryfs_extent *ext, old;
+	uint64_t last = end, start, stop;
+	uint32_t cut;
+	int slot, ret;
+
+	while (last > from) {
+		ret = pantryfs_ext_seek(map, last - 1, &slot);
+		if (ret)
+			return ret;
+		if (slot < 0)
+			break;
+
+		ext = &map->ext[slot];
+		start = ext->ee_block;
+		stop = pantryfs_ext_end(ext);
+		if (stop <= from)
+			break;
+
+		if (start < from && stop > last) {
+			ret = pantryfs_ext_split(map, slot, last);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		if (start < from) {
+			/* Trim the tail. */
+			cut = stop - from;
+			pantryfs_ext_set_len(ext, from - start);
+			pantryfs_ext_dirty(map, slot);
+			pantryfs_free_blocks(sb, ext->ee_start + (from - start),
+				cut);
+			last = from;
+		} else if (stop > last) {
+			/* Trim the head. */
+			cut = last - start;
+			pantryfs_free_blocks(sb, ext->ee_start, cut);
+			ext->ee_block += cut;
+			ext->ee_start += cut;
+			pantryfs_ext_set_len(ext, stop - last);
+			pantryfs_ext_dirty(map, slot);
+			last = start;
+		} else {
+			/* Drop it from the map before its blocks are freed. */
+			old = *ext;
+			cut = stop - start;
+			ret = pantryfs_ext_delete(map, slot);
+			if (ret)
+				return ret;
+			pantryfs_free_blocks(sb, old.ee_start, cut);
+			last = start;
+		}
+		map->inode->i_blocks -=
+			(blkcnt_t) cut << (sb->s_blocksize_bits - 9);
+	}
+	return 0;
+}
+
+/* Give unwritten extents to the holes in [@from, @end). */
+static int pantryfs_ext_prealloc(struct pantryfs_extent_map *map,
+		uint32_t from, uint64_t end)
+{
+	struct inode *inode = map->inode;
+	struct super_block *sb = inode->i_sb;
+	struct pantryfs_extent *ext, new_ext;
+	uint64_t lblk = from, hole_end, goal, pblk;
+	s64 want;
+	int slot, ret, err;
+
+	while (lblk < end) {
+		ret = pantryfs_ext_seek(map, lblk, &slot);
+		if (ret)
+			return ret;
+		goal = pantryfs_inode_goal(inode);
+		if (slot >= 0) {
+			ext = &map->ext[slot];
+			if (lblk < pantryfs_ext_end(ext)) {
+				lblk = pantryfs_ext_end(ext);
+				continue;
+			}
+			goal = ext->ee_start + (lblk - ext->ee_block);
+		}
+		ret = pantryfs_ext_next_start(map, slot, &hole_end);
+		if (ret)
+			return ret;
+		hole_end = min(hole_end, end);
+
+		/* Blocks promised to dirty pages are not ours to take. */
+		want = min_t(uint64_t, hole_end - lblk, PANTRYFS_EXT_MAX_LEN);
+		ret = pantryfs_reserve_blocks(sb, want);
+		if (ret)
+			return ret;
+		ret = pantryfs_alloc_blocks(sb, goal, want, &pblk);
+		pantryfs_release_blocks(sb, want);
+		if (ret < 0)
+			return ret;
+
+		new_ext.ee_block = lblk;
+		new_ext.ee_len = ret | PANTRYFS_EXT_UNWRITTEN;
+		new_ext.ee_start = pblk;
+		err = pantryfs_ext_add(map, slot, &new_ext);
+		if (err) {
+			pantryfs_free_blocks(sb, pblk, ret);
+			return err;
+		}
+
+		inode->i_blocks += (blkcnt_t) ret << (sb->s_blocksize_bits - 9);
+		lblk += ret;
+	}
+	return 0;
+}
+
+/* Block states reported by pantryfs_map_blocks(). */
+#define PANTRYFS_MAP_NEW 0x1	   /* Just allocated: holds garbage */
+#define PANTRYFS_MAP_UNWRITTEN 0x2 /* In an unwritten extent: reads as zeros
+				    * until pantryfs_convert_unwritten()
+				    */
+
+/* Flags for pantryfs_map_blocks(). */
+#define PANTRYFS_GET_CREATE 0x1	   /* Allocate holes */
+#define PANTRYFS_GET_RESERVED 0x2  /* The caller already holds reservations
+				    * for the blocks to allocate
+				    */
+
+/**
+ * Map up to @max logical blocks of @inode, starting at @lblk, onto the device.
+ * Returns the number of contiguous blocks mapped starting at *@pblk, 0 if
+ * @lblk falls in a hole and @create is false, or a negative errno.
+ *
+ * @inode:	The file whose extent map is consulted.
+ * @lblk:	First logical block to map.
+ * @max:	Upper bound on the length of the mapping.
+ * @pblk:	Set to the device block backing @lblk.
+ * @flags:	PANTRYFS_GET_* flags. Without PANTRYFS_GET_RESERVED, blocks
+ *		are reserved here before they are allocated, so that they are
+ *		not taken from those promised to delayed allocation.
+ * @state:	If not NULL, set to the PANTRYFS_MAP_* state of the blocks.
+ */
+static int pantryfs_map_blocks(struct inode *inode, uint32_t lblk,
+		unsigned int max, uint64_t *pblk, unsigned int flags,
+		unsigned int *state)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pantryfs_extent_map map;
+	struct pantryfs_extent *ext, new_ext;
+	uint64_t hole_end = (uint64_t) U32_MAX + 1;
+	uint64_t goal = pantryfs_inode_goal(inode);
+	bool create = flags & PANTRYFS_GET_CREATE;
+	unsigned int want, mstate = 0;
+	int slot, ret, err;
+
+	if (create)
+		down_write(&PFS_I(inode)->map_sem);
+	else
+		down_read(&PFS_I(inode)->map_sem);
+	ret = pantryfs_ext_load(inode, &map);
+	if (ret)
+		goto out_unlock;
+
+	ret = pantryfs_ext_seek(&map, lblk, &slot);
+	if (ret)
+		goto out_release;
+	if (slot >= 0) {
+		ext = &map.ext[slot];
+		if (lblk < pantryfs_ext_end(ext)) {
+			*pblk = ext->ee_start + (lblk - ext->ee_block);
+			ret = min_t(uint64_t, max,
+				pantryfs_ext_end(ext) - lblk);
+			/* Writers are given unwritten blocks as they are, and
+			 * convert them once the data has been sent to them.
+			 */
+			if (pantryfs_ext_unwritten(ext))
+				mstate = PANTRYFS_MAP_UNWRITTEN;
+			goto out_release;
+		}
+		/* Try to keep the file physically contiguous. */
+		goal = ext->ee_start + (lblk - ext->ee_block);
+	}
+	ret = pantryfs_ext_next_start(&map, slot, &hole_end);
+	if (ret)
+		goto out_release;
+
+	if (!create) {
+		ret = 0;
+		goto out_release;
+	}
+
+	want = min_t(uint64_t, min_t(uint64_t, max, hole_end - lblk),
+		PANTRYFS_EXT_MAX_LEN);
+	if (!(flags & PANTRYFS_GET_RESERVED)) {
+		/* Settle for a single block if that is all there is. */
+		err = pantryfs_reserve_blocks(sb, want);
+		if (err && want > 1) {
+			want = 1;
+			err = pantryfs_reserve_blocks(sb, want);
+		}
+		if (err) {
+			ret = err;
+			goto out_release;
+		}
+	}
+	ret = pantryfs_alloc_blocks(sb, goal, want, pblk);
+	if (!(flags & PANTRYFS_GET_RESERVED))
+		pantryfs_release_blocks(sb, want);
+	if (ret < 0)
+		goto out_release;
+
+	new_ext.ee_block = lblk;
+	new_ext.ee_len = ret;
+	new_ext.ee_start = *pblk;
+	err = pantryfs_ext_add(&map, slot, &new_ext);
+	if (err) {
+		pantryfs_free_blocks(sb, *pblk, ret);
+		ret = err;
+		goto out_release;
+	}
+
+	inode->i_blocks += (blkcnt_t) ret << (sb->s_blocksize_bits - 9);
+	mstate = PANTRYFS_MAP_NEW;
+out_release:
+	pantryfs_ext_release(&map);
+out_unlock:
+	if (create)
+		up_write(&PFS_I(inode)->map_sem);
+	else
+		up_read(&PFS_I(inode)->map_sem);
+	if (state)
+		*state = mstate;
+	return ret;
+}
+
+/* Free every block of @inode from logical block @from onwards. */
+static int pantryfs_ext_truncate(struct inode *inode, uint32_t from)
+{
+	struct pantryfs_extent_map map;
+	int ret;
+
+	down_write(&PFS_I(inode)->map_sem);
+	ret = pantryfs_ext_load(inode, &map);
+	if (!ret) {
+		/* Trimming from the end never needs a new extent. */
+		ret = pantryfs_ext_remove(&map, from, (uint64_t) U32_MAX + 1);
+		pantryfs_ext_release(&map);
+	}
+	up_write(&PFS_I(inode)->map_sem);
+	return ret;
+}
+
+/* Mark the blocks of @inode in [@from, @end) written, once the data meant for
+ * them has been sent to the device. Only unwritten extents change.
+ */
+static int pantryfs_convert_unwritten(struct inode *inode, uint32_t from,
+		uint64_t end)
+{
+	struct pantryfs_extent_map map;
+	int ret;
+
+	down_write(&PFS_I(inode)->map_sem);
+	ret = pantryfs_ext_load(inode, &map);
+	if (!ret) {
+		ret = pantryfs_ext_set_state(&map, from, end, false);
+		pantryfs_ext_release(&map);
+	}
+	up_write(&PFS_I(inode)->map_sem);
+	return ret;
+}
+
+/* Number of 512-byte sectors held by the extent map, for i_blocks. */
+static blkcnt_t pantryfs_count_blocks(struct inode *inode)
+{
+	struct pantryfs_extent_map map;
+	blkcnt_t blocks;
+	int node, slot, leaves;
+
+	if (pantryfs_ext_load(inode, &map))
+		return 0;
+
+	leaves = pantryfs_ext_nr_leaves(&map);
+	blocks = leaves + (map.index_bh ? 1 : 0);
+	for (node = -1; node < leaves; node++) {
+		if (pantryfs_ext_load_node(&map, node))
+			break;
+		for (slot = 0; slot < pantryfs_ext_nr(&map); slot++)
+			blocks += pantryfs_ext_len(&map.ext[slot]);
+	}
+
+	pantryfs_ext_release(&map);
+	return blocks << (inode->i_sb->s_blocksize_bits - 9);
+}
+
+/**
+ * get_block_t for the generic buffer and mpage helpers. For reading, blocks
+ * of unwritten extents are left unmapped. For writing, they are mapped and
+ * marked new and unwritten; whoever writes them then calls
+ * pantryfs_convert_unwritten() once the data has been sent.
+ */
+static int pantryfs_get_block(struct inode *inode, sector_t iblock,
+		struct buffer_head *bh_result, int create)
+{
+	unsigned int max = bh_result->b_size >> inode->i_blkbits;
+	unsigned int state, flags = 0;
+	uint64_t pblk;
+	int ret;
+
+	if (iblock > U32_MAX)
+		return create ? -EFBIG : 0;
+
+	if (create) {
+		flags = PANTRYFS_GET_CREATE;
+		/* A delayed buffer's block was reserved when it was dirtied. */
+		if (buffer_delay(bh_result))
+			flags |= PANTRYFS_GET_RESERVED;
+	}
+	ret = pantryfs_map_blocks(inode, iblock, max ? max : 1, &pblk, flags,
+		&state);
+	if (ret <= 0)
+		return ret;
+
+	/* Unwritten blocks read as a hole. */
+	if ((state & PANTRYFS_MAP_UNWRITTEN) && !create)
+		return 0;
+
+	/* A delayed buffer's reservation is used up by its new block, and not
+	 * needed for a preallocated one.
+	 */
+	if ((state & (PANTRYFS_MAP_NEW | PANTRYFS_MAP_UNWRITTEN)) &&
+	    buffer_delay(bh_result))
+		pantryfs_release_blocks(inode->i_sb, 1);
+
+	map_bh(bh_result, inode->i_sb, pblk);
+	if (state & (PANTRYFS_MAP_NEW | PANTRYFS_MAP_UNWRITTEN))
+		set_buffer_new(bh_result);
+	if (state & PANTRYFS_MAP_UNWRITTEN)
+		set_buffer_unwritten(bh_result);
+	bh_result->b_size = (size_t) ret << inode->i_blkbits;
+	return 0;
+}
+
+/* dio->private of a direct write that went to unwritten blocks. */
+#define PANTRYFS_DIO_UNWRITTEN ((void *) 1)
+
+/* get_block_t for direct I/O. A write to unwritten blocks is completed from
+ * a workqueue, where pantryfs_dio_end_io() can convert them.
+ */
+static int pantryfs_get_block_dio(struct inode *inode, sector_t iblock,
+		struct buffer_head *bh_result, int create)
+{
+	int ret = pantryfs_get_block(inode, iblock, bh_result, create);
+
+	if (!ret && buffer_unwritten(bh_result)) {
+		set_buffer_defer_completion(bh_result);
+		bh_result->b_private = PANTRYFS_DIO_UNWRITTEN;
+	}
+	return ret;
+}
+
+/* dio_iodone_t: mark the blocks a direct write reached as written. */
+static int pantryfs_dio_end_io(struct kiocb *iocb, loff_t offset,
+		ssize_t size, void *private)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+
+	if (private != PANTRYFS_DIO_UNWRITTEN || size <= 0)
+		return 0;
+	return pantryfs_convert_unwritten(inode, offset >> inode->i_blkbits,
+		DIV_ROUND_UP(offset + size, PFS_BLOCK_SIZE));
+}
+
+/**
+ * get_block_t for buffered writes and write faults. A hole is not given a
+ * block; instead a free block is reserved and the buffer is marked delayed.
+ * The block is allocated when the page is written back, by which time
+ * neighbouring pages are dirty too and can be placed next to it.
+ */
+static int pantryfs_get_block_delay(struct inode *inode, sector_t iblock,
+		struct buffer_head *bh_result, int create)
+{
+	unsigned int state;
+	uint64_t pblk;
+	int ret;
+
+	if (iblock > U32_MAX)
+		return -EFBIG;
+
+	ret = pantryfs_map_blocks(inode, iblock, 1, &pblk, 0, &state);
+	if (ret < 0)
+		return ret;
+	if (ret) {
+		map_bh(bh_result, inode->i_sb, pblk);
+		/* A preallocated block is written in place. Being new, it is
+		 * zeroed in the page where the write does not cover it. Being
+		 * unwritten, it is converted by writeback once the page's data
+		 * has been sent to it.
+		 */
+		if (state & PANTRYFS_MAP_UNWRITTEN) {
+			set_buffer_new(bh_result);
+			set_buffer_unwritten(bh_result);
+		}
+		return 0;
+	}
+
+	ret = pantryfs_reserve_blocks(inode->i_sb, 1);
+	if (ret)
+		return ret;
+
+	/* Mapped, so that the buffer helpers leave it alone, but to no block. */
+	map_bh(bh_result, inode->i_sb, ~(sector_t) 0);
+	set_buffer_new(bh_result);
+	set_buffer_delay(bh_result);
+	return 0;
+}
+
+/* Fill the locked page @page of @inode from its inline data. */
+static void pantryfs_inline_fill_page(struct inode *inode, struct page *page)
+{
+	char *kaddr;
+
+	/* map_sem may sleep, so it is taken outside the atomic mapping. */
+	down_read(&PFS_I(inode)->map_sem);
+	kaddr = kmap_atomic(page);
+	memset(kaddr, 0, PAGE_SIZE);
+	if (!page->index)
+		memcpy(kaddr, PFS_INODE(inode)->inline_data,
+			PANTRYFS_INLINE_DATA_SIZE);
+	flush_dcache_page(page);
+	kunmap_atomic(kaddr);
+	up_read(&PFS_I(inode)->map_sem);
+	SetPageUptodate(page);
+}
+
+/* Copy page 0 of @inode, up to the file's size, back into the inline data.
+ * Anything past EOF, as a shared mapping may have put there, is left out.
+ */
+static void pantryfs_inline_store_page(struct inode *inode, struct page *page)
+{
+	unsigned int len = min_t(loff_t, i_size_read(inode),
+		PANTRYFS_INLINE_DATA_SIZE);
+	char *kaddr;
+
+	down_write(&PFS_I(inode)->map_sem);
+	kaddr = kmap_atomic(page);
+	memcpy(PFS_INODE(inode)->inline_data, kaddr, len);
+	kunmap_atomic(kaddr);
+	memset(PFS_INODE(inode)->inline_data + len, 0,
+		PANTRYFS_INLINE_DATA_SIZE - len);
+	up_write(&PFS_I(inode)->map_sem);
+	mark_inode_dirty(inode);
+}
+
+/**
+ * Move the inline data of @inode out to a data block, which becomes the
+ * file's first extent. The data goes through page 0 of the file, which is
+ * left dirty for writeback to store. The caller must hold the inode lock.
+ * Does nothing if the file has no inline data.
+ */
+static int pantryfs_inline_spill(struct inode *inode)
+{
+	struct pantryfs_inode *pfs_inode = PFS_INODE(inode);
+	struct page *page;
+	char *kaddr;
+	int ret;
+
+	if (!pantryfs_has_inline_data(inode))
+		return 0;
+
+	page = find_or_create_page(inode->i_mapping, 0,
+		mapping_gfp_constraint(inode->i_mapping, ~__GFP_FS));
+	if (!page)
+		return -ENOMEM;
+	if (!PageUptodate(page))
+		pantryfs_inline_fill_page(inode, page);
+
+	/* The page now holds the data, so the extent map can take over. */
+	down_write(&PFS_I(inode)->map_sem);
+	memset(pfs_inode->inline_data, 0, PANTRYFS_INLINE_DATA_SIZE);
+	pfs_inode->flags &= ~PANTRYFS_INLINE_DATA_FL;
+	up_write(&PFS_I(inode)->map_sem);
+
+	ret = __block_write_begin(page, 0, PAGE_SIZE, pantryfs_get_block_delay);
+	if (ret) {
+		down_write(&PFS_I(inode)->map_sem);
+		kaddr = kmap_atomic(page);
+		pfs_inode->flags |= PANTRYFS_INLINE_DATA_FL;
+		memcpy(pfs_inode->inline_data, kaddr, PANTRYFS_INLINE_DATA_SIZE);
+		kunmap_atomic(kaddr);
+		up_write(&PFS_I(inode)->map_sem);
+	} else {
+		block_commit_write(page, 0, PAGE_SIZE);
+	}
+
+	unlock_page(page);
+	put_page(page);
+	mark_inode_dirty(inode);
+	return ret;
+}
+
+/* Pick the inode and file operations matching the type of @inode. */
+static int pantryfs_set_ops(struct inode *inode)
+{
+	switch (inode->i_mode & S_IFMT) {
+	case S_IFDIR:
+		inode->i_op = &pantryfs_inode_ops;
+		inode->i_fop = &pantryfs_dir_ops;
+		break;
+	case S_IFREG:
+		inode->i_op = &pantryfs_file_inode_ops;
+		inode->i_fop = &pantryfs_file_ops;
+		inode->i_mapping->a_ops = &pantryfs_aops;
+		break;
+	case S_IFLNK:
+		/* Short targets are kept in the inode and need no I/O. */
+		if (pantryfs_has_inline_data(inode)) {
+			inode->i_op = &pantryfs_fast_symlink_inode_ops;
+			inode->i_link = PFS_INODE(inode)->inline_data;
+		} else {
+			inode->i_op = &pantryfs_symlink_inode_ops;
+			inode_nohighmem(inode);
+			inode->i_mapping->a_ops = &pantryfs_aops;
+		}
+		break;
+	default:
+		pr_err("Unsupported mode for pantryfs: %d\n", inode->i_mode);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static struct inode *pantryfs_iget(struct super_block *sb, unsigned long ino)
+{
+	struct pantryfs_inode *pfs_inode;
+	struct buffer_head *bh;
+	struct inode *inode;
+	unsigned int slot;
+	uint64_t block;
+
+	if (ino < PANTRYFS_ROOT_INODE_NUMBER || ino > PFS_DISK_SB(sb)->inodes_count)
+		return ERR_PTR(-EIO);
+
+	inode = iget_locked(sb, ino);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	if (!(inode->i_state & I_NEW))
+		return inode;
+
+	block = pantryfs_inode_block(sb, ino, &slot);
+	bh = sb_bread(sb, block);
+	if (!bh) {
+		iget_failed(inode);
+		return ERR_PTR(-EIO);
+	}
+
+	pfs_inode = PFS_INODE(inode);
+	memcpy(pfs_inode, (struct pantryfs_inode *) bh->b_data + slot,
+		sizeof(*pfs_inode));
+	brelse(bh);
+
+	inode->i_mode = pfs_inode->mode;
+	i_uid_write(inode, pfs_inode->uid);
+	i_gid_write(inode, pfs_inode->gid);
+	set_nlink(inode, pfs_inode->nlink);
+	inode->i_atime = pfs_inode->i_atime;
+	inode->i_mtime = pfs_inode->i_mtime;
+	inode->i_ctime = pfs_inode->i_ctime;
+	i_size_write(inode, pfs_inode->file_size);
+	inode->i_blocks = pantryfs_count_blocks(inode);
+
+	if (pantryfs_set_ops(inode)) {
+		iget_failed(inode);
+		return ERR_PTR(-EIO);
+	}
+
+	unlock_new_inode(inode);
+	return inode;
+}
+
+/* Claim a free inode of @group, putting its number in *@ino. */
+static int pantryfs_group_alloc_ino(struct super_block *sb, unsigned long group,
+		bool is_dir, unsigned long *ino)
+{
+	unsigned long ipg = PFS_DISK_SB(sb)->inodes_per_group, bit;
+	struct pantryfs_group_info *gi = &PFS_SB(sb)->groups[group];
+	struct pantryfs_group_desc *gd;
+	struct buffer_head *gd_bh, *bh;
+	int ret = -ENOSPC;
+
+	gd = pantryfs_group_desc(sb, group, &gd_bh);
+	if (!gd->free_inodes_count)
+		return -ENOSPC;
+
+	mutex_lock(&gi->lock);
+	bh = sb_bread(sb, gd->inode_bitmap);
+	if (!bh) {
+		ret = -EIO;
+		goto out_unlock;
+	}
+
+	bit = find_next_zero_bit_le(bh->b_data, ipg, gi->inode_hint);
+	gi->inode_hint = bit;
+	if (bit < ipg) {
+		__set_bit_le(bit, bh->b_data);
+		mark_buffer_dirty(bh);
+		gi->inode_hint = bit + 1;
+
+		gd->free_inodes_count--;
+		if (is_dir)
+			gd->used_dirs_count++;
+		mark_buffer_dirty(gd_bh);
+		percpu_counter_dec(&PFS_SB(sb)->free_inodes);
+
+		*ino = group * ipg + bit + 1;
+		ret = 0;
+	}
+	brelse(bh);
+out_unlock:
+	mutex_unlock(&gi->lock);
+	return ret;
+}
+
+/* Group for a new file in @dir: the directory's own, so the file sits close
+ * to it, or failing that one picked by quadratic probing from there.
+ */
+static unsigned long pantryfs_find_group_other(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	unsigned long ngroups = PFS_DISK_SB(sb)->groups_count;
+	unsigned long parent = pantryfs_ino_group(sb, dir->i_ino), group, i;
+	struct pantryfs_group_desc *gd;
+
+	gd = pantryfs_group_desc(sb, parent, NULL);
+	if (gd->free_inodes_count && gd->free_blocks_count)
+		return parent;
+
+	/* Hash on the directory so siblings of full groups spread out. */
+	group = (parent + dir->i_ino) % ngroups;
+	for (i = 1; i < ngroups; i <<= 1) {
+		group = (group + i) % ngroups;
+		gd = pantryfs_group_desc(sb, group, NULL);
+		if (gd->free_inodes_count && gd->free_blocks_count)
+			return group;
+	}
+	return parent;
+}
+
+/**
+ * Group for a new directory in @dir, in the manner of the Orlov allocator.
+ * Top-level directories are spread out to the emptier groups with the fewest
+ * directories, so that unrelated trees do not share groups. Deeper ones stay
+ * in their parent's group, unless it is crowded compared to the rest of the
+ * filesystem.
+ */
+static unsigned long pantryfs_find_group_dir(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct pantryfs_super_block *pfs_sb = PFS_DISK_SB(sb);
+	unsigned long ngroups = pfs_sb->groups_count;
+	unsigned long parent = pantryfs_ino_group(sb, dir->i_ino);
+	unsigned long group, best = ngroups, i;
+	uint64_t freei = 0, freeb = 0, ndirs = 0;
+	uint64_t avefreei, avefreeb, max_dirs;
+	struct pantryfs_group_desc *gd;
+
+	for (group = 0; group < ngroups; group++) {
+		gd = pantryfs_group_desc(sb, group, NULL);
+		freei += gd->free_inodes_count;
+		freeb += gd->free_blocks_count;
+		ndirs += gd->used_dirs_count;
+	}
+	avefreei = freei / ngroups;
+	avefreeb = freeb / ngroups;
+
+	if (dir->i_ino == PANTRYFS_ROOT_INODE_NUMBER) {
+		group = prandom_u32() % ngroups;
+		for (i = 0; i < ngroups; i++, group = (group + 1) % ngroups) {
+			gd = pantryfs_group_desc(sb, group, NULL);
+			if (gd->free_inodes_count < avefreei ||
+			    gd->free_blocks_count < avefreeb)
+				continue;
+			if (best == ngroups || gd->used_dirs_count <
+			    pantryfs_group_desc(sb, best, NULL)->used_dirs_count)
+				best = group;
+		}
+		if (best != ngroups)
+			return best;
+	} else {
+		max_dirs = ndirs / ngroups + pfs_sb->inodes_per_group / 16;
+		group = parent;
+		for (i = 0; i < ngroups; i++, group = (group + 1) % ngroups) {
+			gd = pantryfs_group_desc(sb, group, NULL);
+			if (gd->used_dirs_count < max_dirs &&
+			    gd->free_inodes_count >= avefreei - avefreei / 4 &&
+			    gd->free_blocks_count >= avefreeb - avefreeb / 4)
+				return group;
+		}
+	}
+
+	/* Fall back to any group with an above-average number of free inodes. */
+	group = parent;
+	for (i = 0; i < ngroups; i++, group = (group + 1) % ngroups) {
+		gd = pantryfs_group_desc(sb, group, NULL);
+		if (gd->free_inodes_count && gd->free_inodes_count >= avefreei)
+			return group;
+	}
+	return parent;
+}
+
+/* Find and claim a free inode number for a file of type @mode in @dir. */
+static int pantryfs_alloc_ino(struct inode *dir, umode_t mode, unsigned long *ino)
+{
+	struct super_block *sb = dir->i_sb;
+	unsigned long ngroups = PFS_DISK_SB(sb)->groups_count, group, i;
+	int ret;
+
+	if (S_ISDIR(mode))
+		group = pantryfs_find_group_dir(dir);
+	else
+		group = pantryfs_find_group_other(dir);
+
+	/* The group may have filled up since it was picked. */
+	for (i = 0; i < ngroups; i++, group = (group + 1) % ngroups) {
+		ret = pantryfs_group_alloc_ino(sb, group, S_ISDIR(mode), ino);
+		if (ret != -ENOSPC)
+			return ret;
+	}
+	return -ENOSPC;
+}
+
+static void pantryfs_free_ino(struct super_block *sb, unsigned long ino,
+		bool is_dir)
+{
+	unsigned long ipg = PFS_DISK_SB(sb)->inodes_per_group;
+	unsigned long group = pantryfs_ino_group(sb, ino);
+	struct pantryfs_group_info *gi = &PFS_SB(sb)->groups[group];
+	struct pantryfs_group_desc *gd;
+	struct buffer_head *gd_bh, *bh;
+
+	gd = pantryfs_group_desc(sb, group, &gd_bh);
+
+	mutex_lock(&gi->lock);
+	bh = sb_bread(sb, gd->inode_bitmap);
+	if (!bh) {
+		mutex_unlock(&gi->lock);
+		pr_err("Pantryfs: leaking inode %lu\n", ino);
+		return;
+	}
+	__clear_bit_le((ino - 1) % ipg, bh->b_data);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	gi->inode_hint = min(gi->inode_hint, (ino - 1) % ipg);
+
+	gd->free_inodes_count++;
+	if (is_dir)
+		gd->used_dirs_count--;
+	mark_buffer_dirty(gd_bh);
+	mutex_unlock(&gi->lock);
+	percpu_counter_inc(&PFS_SB(sb)->free_inodes);
+}
+
+/**
+ * Allocate an inode for a new file of type @mode in directory @dir. The inode
+ * is returned locked and hashed; the caller finishes with d_instantiate_new()
+ * or, on failure, clear_nlink() and discard_new_inode().
+ *
+ * @dir:	The directory the file is being created in.
+ * @mode:	Type and permissions of the new file.
+ */
+static struct inode *pantryfs_new_inode(struct inode *dir, umode_t mode)
+{
+	struct super_block *sb = dir->i_sb;
+	struct pantryfs_inode *pfs_inode;
+	struct inode *inode;
+	unsigned long ino;
+	int ret;
+
+	inode = new_inode(sb);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	pfs_inode = PFS_INODE(inode);
+
+	ret = pantryfs_alloc_ino(dir, mode, &ino);
+	if (ret) {
+		make_bad_inode(inode);
+		iput(inode);
+		return ERR_PTR(ret);
+	}
+
+	inode->i_ino = ino;
+	inode_init_owner(inode, dir, mode);
+	if (S_ISREG(inode->i_mode))
+		pfs_inode->flags |= PANTRYFS_INLINE_DATA_FL;
+	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+	pantryfs_set_ops(inode);
+
+	if (insert_inode_locked(inode) < 0) {
+		pr_err("Pantryfs: inode %lu is already in use\n", ino);
+		/* evict() skips bad inodes, so give the number back here. */
+		pantryfs_free_ino(sb, ino, S_ISDIR(mode));
+		make_bad_inode(inode);
+		iput(inode);
+		return ERR_PTR(-EIO);
+	}
+
+	mark_inode_dirty(inode);
+	return inode;
+}
+
+/* Read logical block @lblk of directory @dir. */
+static struct buffer_head *pantryfs_dir_bread(struct inode *dir, uint32_t lblk)
+{
+	struct buffer_head *bh;
+	uint64_t pblk;
+	int ret;
+
+	ret = pantryfs_map_blocks(dir, lblk, 1, &pblk, 0, NULL);
+	if (ret <= 0)
+		return ERR_PTR(ret ? ret : -EIO);
+
+	bh = sb_bread(dir->i_sb, pblk);
+	return bh ? bh : ERR_PTR(-EIO);
+}
+
+/* Grow directory @dir by one empty block, whose number is put in *@lblk. */
+static struct buffer_head *pantryfs_dir_append(struct inode *dir, uint32_t *lblk)
+{
+	struct super_block *sb = dir->i_sb;
+	struct buffer_head *bh;
+	uint64_t pblk;
+	int ret;
+
+	*lblk = i_size_read(dir) >> sb->s_blocksize_bits;
+	ret = pantryfs_map_blocks(dir, *lblk, 1, &pblk, PANTRYFS_GET_CREATE,
+		NULL);
+	if (ret < 0)
+		return ERR_PTR(ret);
+
+	bh = sb_getblk(sb, pblk);
+	if (!bh)
+		return ERR_PTR(-ENOMEM);
+	lock_buffer(bh);
+	memset(bh->b_data, 0, PFS_BLOCK_SIZE);
+	((struct pantryfs_dir_entry *) bh->b_data)->rec_len = PFS_BLOCK_SIZE;
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, dir);
+
+	i_size_write(dir, (loff_t) (*lblk + 1) << sb->s_blocksize_bits);
+	mark_inode_dirty(dir);
+	return bh;
+}
+
+/* FNV-1a over the filename. It is stored on disk, so it must never change. */
+static uint32_t pantryfs_name_hash(const void *name, unsigned int len)
+{
+	const unsigned char *p = name;
+	uint32_t hash = 0x811c9dc5;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+static inline struct pantryfs_dir_entry *pantryfs_next_entry(
+		struct pantryfs_dir_entry *de)
+{
+	return (struct pantryfs_dir_entry *) ((char *) de + de->rec_len);
+}
+
+/* Sanity check the record @de of directory block @bh before following it. */
+static int pantryfs_check_entry(struct inode *dir, struct buffer_head *bh,
+		struct pantryfs_dir_entry *de)
+{
+	unsigned int offset = (char *) de - bh->b_data;
+
+	if (de->rec_len < PANTRYFS_DIR_REC_LEN(0) ||
+	    de->rec_len % PANTRYFS_DIR_ROUND ||
+	    de->rec_len < PANTRYFS_DIR_REC_LEN(de->name_len) ||
+	    offset + de->rec_len > PFS_BLOCK_SIZE) {
+		pr_err("Pantryfs: bad entry in directory %lu at offset %u\n",
+			dir->i_ino, offset);
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * Look @name up in directory block @bh. Returns the entry, NULL if there is
+ * no such entry in this block, or an ERR_PTR if the block is corrupt.
+ */
+static struct pantryfs_dir_entry *pantryfs_search_block(struct inode *dir,
+		struct buffer_head *bh, const struct qstr *name)
+{
+	struct pantryfs_dir_entry *de = (struct pantryfs_dir_entry *) bh->b_data;
+	char *end = bh->b_data + PFS_BLOCK_SIZE;
+
+	for (; (char *) de < end; de = pantryfs_next_entry(de)) {
+		if (pantryfs_check_entry(dir, bh, de))
+			return ERR_PTR(-EIO);
+		if (de->inode_no && de->name_len == name->len &&
+		    !memcmp(de->filename, name->name, name->len))
+			return de;
+	}
+	return NULL;
+}
+
+/**
+ * Put an entry for @inode named @name into directory block @bh, carving
+ * it out of an unused record or of the slack at the end of a used one.
+ * Returns -ENOSPC if no record has enough room.
+ */
+static int pantryfs_insert_in_block(struct inode *dir, struct buffer_head *bh,
+		const struct qstr *name, struct inode *inode)
+{
+	struct pantryfs_dir_entry *de = (struct pantryfs_dir_entry *) bh->b_data;
+	struct pantryfs_dir_entry *new;
+	char *end = bh->b_data + PFS_BLOCK_SIZE;
+	unsigned int used, need = PANTRYFS_DIR_REC_LEN(name->len);
+
+	for (; (char *) de < end; de = pantryfs_next_entry(de)) {
+		if (pantryfs_check_entry(dir, bh, de))
+			return -EIO;
+
+		used = de->inode_no ? PANTRYFS_DIR_REC_LEN(de->name_len) : 0;
+		if (de->rec_len - used < need)
+			continue;
+
+		if (used) {
+			new = (struct pantryfs_dir_entry *) ((char *) de + used);
+			new->rec_len = de->rec_len - used;
+			de->rec_len = used;
+			de = new;
+		}
+		de->inode_no = inode->i_ino;
+		de->name_len = name->len;
+		de->file_type = fs_umode_to_ftype(inode->i_mode);
+		memcpy(de->filename, name->name, name->len);
+		mark_buffer_dirty_inode(bh, dir);
+		return 0;
+	}
+	return -ENOSPC;
+}
+
+/* Remove entry @de from directory block @bh, merging it into the record in
+ * front of it, if any.
+ */
+static int pantryfs_delete_entry(struct inode *dir, struct buffer_head *bh,
+		struct pantryfs_dir_entry *de)
+{
+	struct pantryfs_dir_entry *prev = NULL;
+	struct pantryfs_dir_entry *pde = (struct pantryfs_dir_entry *) bh->b_data;
+
+	for (; pde != de; prev = pde, pde = pantryfs_next_entry(pde))
+		if (pantryfs_check_entry(dir, bh, pde))
+			return -EIO;
+
+	if (prev)
+		prev->rec_len += de->rec_len;
+	else
+		de->inode_no = 0;
+	inode_inc_iversion(dir);
+	mark_buffer_dirty_inode(bh, dir);
+	return 0;
+}
+
+/* One step of a walk down the directory index. */
+struct pantryfs_dx_frame {
+	struct buffer_head *bh;
+	struct pantryfs_dx_block *dx;
+	unsigned int at;	/* Index of the entry the walk followed */
+};
+
+static void pantryfs_dx_release(struct pantryfs_dx_frame *frames, int nframes)
+{
+	while (nframes--)
+		brelse(frames[nframes].bh);
+}
+
+/* Returns the index of the last entry of @dx whose hash is <= @hash. */
+static unsigned int pantryfs_dx_search(struct pantryfs_dx_block *dx, uint32_t hash)
+{
+	unsigned int lo = 1, hi = dx->count;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (dx->entries[mid].hash <= hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+/**
+ * Walk the index of @dir from the root down to the leaf covering @hash,
+ * recording the index blocks visited in @frames. Returns the leaf's logical
+ * block, or a negative errno.
+ *
+ * @dir:	An indexed directory.
+ * @hash:	Hash of the name being looked for.
+ * @frames:	Room for PANTRYFS_DX_MAX_LEVELS + 1 frames.
+ * @nframes:	Set to the number of frames filled in, which must be released.
+ */
+static int pantryfs_dx_probe(struct inode *dir, uint32_t hash,
+		struct pantryfs_dx_frame *frames, int *nframes)
+{
+	struct pantryfs_dx_frame *frame;
+	uint32_t lblk = 0;
+	int levels = 0, i;
+
+	*nframes = 0;
+	for (i = 0; i <= levels; i++) {
+		frame = &frames[i];
+		frame->bh = pantryfs_dir_bread(dir, lblk);
+		if (IS_ERR(frame->bh))
+			goto fail;
+		(*nframes)++;
+
+		frame->dx = (struct pantryfs_dx_block *) frame->bh->b_data;
+		if (frame->dx->magic != PANTRYFS_DX_MAGIC || !frame->dx->count ||
+		    frame->dx->count > PANTRYFS_DX_LIMIT)
+			goto corrupt;
+		if (!i) {
+			levels = frame->dx->levels;
+			if (levels > PANTRYFS_DX_MAX_LEVELS)
+				goto corrupt;
+		}
+
+		frame->at = pantryfs_dx_search(frame->dx, hash);
+		lblk = frame->dx->entries[frame->at].block;
+	}
+	return lblk;
+
+corrupt:
+	pr_err("Pantryfs: corrupt index in directory %lu\n", dir->i_ino);
+	pantryfs_dx_release(frames, *nframes);
+	return -EIO;
+fail:
+	pantryfs_dx_release(frames, *nframes);
+	return PTR_ERR(frame->bh);
+}
+
+static void pantryfs_dx_insert(struct pantryfs_dx_frame *frame, uint32_t hash,
+		uint32_t block, struct inode *dir)
+{
+	struct pantryfs_dx_entry *at = &frame->dx->entries[frame->at + 1];
+
+	memmove(at + 1, at, (frame->dx->count - frame->at - 1) * sizeof(*at));
+	at->hash = hash;
+	at->block = block;
+	frame->dx->count++;
+	mark_buffer_dirty_inode(frame->bh, dir);
+}
+
+/**
+ * Make sure the index block right above the leaf has room for one more
+ * entry, adding a level below the root or splitting an index node if it is
+ * full. The frames are updated to keep pointing at the path for @hash.
+ */
+static int pantryfs_dx_make_room(struct inode *dir, struct pantryfs_dx_frame *frames,
+		int *nframes, uint32_t hash)
+{
+	struct pantryfs_dx_frame *root = &frames[0], *node = &frames[1];
+	struct pantryfs_dx_block *dx;
+	struct buffer_head *bh;
+	unsigned int half;
+	uint32_t lblk;
+
+	if (frames[*nframes - 1].dx->count < PANTRYFS_DX_LIMIT)
+		return 0;
+
+	if (*nframes == 1) {
+		/* The root points at leaves: move its entries to a new node. */
+		bh = pantryfs_dir_append(dir, &lblk);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+
+		dx = (struct pantryfs_dx_block *) bh->b_data;
+		memcpy(dx, root->dx, PFS_BLOCK_SIZE);
+		dx->levels = 0;
+
+		root->dx->levels = 1;
+		root->dx->count = 1;
+		root->dx->entries[0].hash = 0;
+		root->dx->entries[0].block = lblk;
+		mark_buffer_dirty_inode(root->bh, dir);
+
+		node->bh = bh;
+		node->dx = dx;
+		node->at = root->at;
+		root->at = 0;
+		*nframes = 2;
+		return 0;
+	}
+
+	if (root->dx->count >= PANTRYFS_DX_LIMIT)
+		return -ENOSPC;
+
+	/* Split the node, moving its upper half to a new one. */
+	bh = pantryfs_dir_append(dir, &lblk);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	half = node->dx->count / 2;
+	dx = (struct pantryfs_dx_block *) bh->b_data;
+	dx->magic = PANTRYFS_DX_MAGIC;
+	dx->count = node->dx->count - half;
+	memcpy(dx->entries, &node->dx->entries[half],
+		dx->count * sizeof(dx->entries[0]));
+	node->dx->count = half;
+	mark_buffer_dirty_inode(node->bh, dir);
+
+	pantryfs_dx_insert(root, dx->entries[0].hash, lblk, dir);
+
+	if (hash >= dx->entries[0].hash) {
+		brelse(node->bh);
+		node->bh = bh;
+		node->dx = dx;
+		node->at -= half;
+		root->at++;
+	} else {
+		brelse(bh);
+	}
+	return 0;
+}
+
+/* A live entry of a leaf being split, in the order of its hash. */
+struct pantryfs_dx_map {
+	uint32_t hash;
+	uint16_t offs;
+	uint16_t size;
+};
+
+static int pantryfs_dx_map_cmp(const void *a, const void *b)
+{
+	const struct pantryfs_dx_map *x = a, *y = b;
+
+	return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+/* Pack the records of @from listed in @map tightly into the block @to. */
+static void pantryfs_dir_pack(char *to, const char *from,
+		struct pantryfs_dx_map *map, unsigned int nr)
+{
+	struct pantryfs_dir_entry *de = NULL;
+	unsigned int i, offset = 0;
+
+	memset(to, 0, PFS_BLOCK_SIZE);
+	for (i = 0; i < nr; i++) {
+		de = (struct pantryfs_dir_entry *) (to + offset);
+		memcpy(de, from + map[i].offs, map[i].size);
+		de->rec_len = map[i].size;
+		offset += map[i].size;
+	}
+
+	if (!de)
+		de = (struct pantryfs_dir_entry *) to;
+	de->rec_len += PFS_BLOCK_SIZE - offset;
+}
+
+/**
+ * Split the full leaf @bh, found through @frames, moving the entries whose
+ * hash is at or above the split point into a new leaf. The split point is
+ * picked so the two leaves hold about as many bytes, but entries sharing a
+ * hash must stay in the same leaf. Returns the leaf that now covers @hash,
+ * with @bh released if that is the new one.
+ */
+static struct buffer_head *pantryfs_dx_split_leaf(struct inode *dir,
+		struct pantryfs_dx_frame *frames, int *nframes,
+		struct buffer_head *bh, uint32_t hash)
+{
+	struct pantryfs_dir_entry *de = (struct pantryfs_dir_entry *) bh->b_data;
+	char *end = bh->b_data + PFS_BLOCK_SIZE;
+	struct pantryfs_dx_map *map;
+	struct buffer_head *new_bh;
+	unsigned int nr = 0, mid, size = 0;
+	uint32_t split, lblk;
+	char *copy;
+	int ret = -ENOMEM;
+
+	map = kmalloc_array(PFS_BLOCK_SIZE / PANTRYFS_DIR_REC_LEN(1),
+		sizeof(*map), GFP_NOFS);
+	copy = kmalloc(PFS_BLOCK_SIZE, GFP_NOFS);
+	if (!map || !copy)
+		goto fail;
+
+	for (; (char *) de < end; de = pantryfs_next_entry(de)) {
+		ret = pantryfs_check_entry(dir, bh, de);
+		if (ret)
+			goto fail;
+		if (!de->inode_no)
+			continue;
+		map[nr].hash = pantryfs_name_hash(de->filename, de->name_len);
+		map[nr].offs = (char *) de - bh->b_data;
+		map[nr].size = PANTRYFS_DIR_REC_LEN(de->name_len);
+		size += map[nr++].size;
+	}
+	sort(map, nr, sizeof(*map), pantryfs_dx_map_cmp, NULL);
+
+	for (mid = 0; mid < nr && size > PFS_BLOCK_SIZE / 2; mid++)
+		size -= map[mid].size;
+	while (mid < nr && mid && map[mid].hash == map[mid - 1].hash)
+		mid++;
+	if (mid == nr)
+		while (--mid && map[mid].hash == map[mid - 1].hash)
+			;
+	ret = -ENOSPC;
+	if (!mid)
+		goto fail;
+	split = map[mid].hash;
+
+	ret = pantryfs_dx_make_room(dir, frames, nframes, split);
+	if (ret)
+		goto fail;
+
+	new_bh = pantryfs_dir_append(dir, &lblk);
+	if (IS_ERR(new_bh)) {
+		ret = PTR_ERR(new_bh);
+		goto fail;
+	}
+
+	memcpy(copy, bh->b_data, PFS_BLOCK_SIZE);
+	pantryfs_dir_pack(bh->b_data, copy, map, mid);
+	pantryfs_dir_pack(new_bh->b_data, copy, map + mid, nr - mid);
+	mark_buffer_dirty_inode(bh, dir);
+	mark_buffer_dirty_inode(new_bh, dir);
+	kfree(copy);
+	kfree(map);
+
+	pantryfs_dx_insert(&frames[*nframes - 1], split, lblk, dir);
+
+	if (hash >= split) {
+		brelse(bh);
+		return new_bh;
+	}
+	brelse(new_bh);
+	return bh;
+
+fail:
+	kfree(copy);
+	kfree(map);
+	brelse(bh);
+	return ERR_PTR(ret);
+}
+
+static int pantryfs_dx_add_entry(struct inode *dir, const struct qstr *name,
+		struct inode *inode)
+{
+	struct pantryfs_dx_frame frames[PANTRYFS_DX_MAX_LEVELS + 1];
+	uint32_t hash = pantryfs_name_hash(name->name, name->len);
+	struct buffer_head *bh;
+	int nframes, ret;
+
+	ret = pantryfs_dx_probe(dir, hash, frames, &nframes);
+	if (ret < 0)
+		return ret;
+
+	bh = pantryfs_dir_bread(dir, ret);
+	if (IS_ERR(bh)) {
+		ret = PTR_ERR(bh);
+		goto out;
+	}
+
+	ret = pantryfs_insert_in_block(dir, bh, name, inode);
+	if (ret == -ENOSPC) {
+		bh = pantryfs_dx_split_leaf(dir, frames, &nframes, bh, hash);
+		if (IS_ERR(bh)) {
+			ret = PTR_ERR(bh);
+			goto out;
+		}
+		ret = pantryfs_insert_in_block(dir, bh, name, inode);
+	}
+	brelse(bh);
+out:
+	pantryfs_dx_release(frames, nframes);
+	return ret;
+}
+
+/* Turn the single, full block of linear directory @dir into an index root
+ * pointing at a copy of the block.
+ */
+static int pantryfs_dx_make_indexed(struct inode *dir)
+{
+	struct buffer_head *root_bh, *leaf_bh;
+	struct pantryfs_dx_block *dx;
+	uint32_t lblk;
+
+	root_bh = pantryfs_dir_bread(dir, 0);
+	if (IS_ERR(root_bh))
+		return PTR_ERR(root_bh);
+
+	leaf_bh = pantryfs_dir_append(dir, &lblk);
+	if (IS_ERR(leaf_bh)) {
+		brelse(root_bh);
+		return PTR_ERR(leaf_bh);
+	}
+	memcpy(leaf_bh->b_data, root_bh->b_data, PFS_BLOCK_SIZE);
+	mark_buffer_dirty_inode(leaf_bh, dir);
+	brelse(leaf_bh);
+
+	memset(root_bh->b_data, 0, PFS_BLOCK_SIZE);
+	dx = (struct pantryfs_dx_block *) root_bh->b_data;
+	dx->fake_rec_len = PFS_BLOCK_SIZE;
+	dx->magic = PANTRYFS_DX_MAGIC;
+	dx->count = 1;
+	dx->entries[0].hash = 0;
+	dx->entries[0].block = lblk;
+	mark_buffer_dirty_inode(root_bh, dir);
+	brelse(root_bh);
+
+	PFS_INODE(dir)->flags |= PANTRYFS_INDEX_FL;
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+static void pantryfs_bloom_hash(const void *name, unsigned int len,
+		uint32_t *h1, uint32_t *h2)
+{
+	*h1 = pantryfs_name_hash(name, len);
+	*h2 = jhash(name, len, *h1) | 1;
+}
+
+static void pantryfs_bloom_add(struct pantryfs_dir_bloom *bloom,
+		const void *name, unsigned int len)
+{
+	uint32_t h1, h2, mask = (1U << bloom->bits_shift) - 1;
+	int i;
+
+	pantryfs_bloom_hash(name, len, &h1, &h2);
+	for (i = 0; i < PANTRYFS_BLOOM_PROBES; i++, h1 += h2)
+		set_bit(h1 & mask, bloom->map);
+}
+
+/* Whether @name may be in the directory. A false answer is always right. */
+static bool pantryfs_bloom_test(struct pantryfs_dir_bloom *bloom,
+		const void *name, unsigned int len)
+{
+	uint32_t h1, h2, mask = (1U << bloom->bits_shift) - 1;
+	int i;
+
+	pantryfs_bloom_hash(name, len, &h1, &h2);
+	for (i = 0; i < PANTRYFS_BLOOM_PROBES; i++, h1 += h2)
+		if (!test_bit(h1 & mask, bloom->map))
+			return false;
+	return true;
+}
+
+static void pantryfs_bloom_free(struct rcu_head *head)
+{
+	kvfree(container_of(head, struct pantryfs_dir_bloom, rcu));
+}
+
+/* Unlink the filter of @pi from the superblock. Caller holds bloom_lock. */
+static struct pantryfs_dir_bloom *pantryfs_bloom_detach(
+		struct pantryfs_sb_buffer_heads *sbh, struct pantryfs_inode_info *pi)
+{
+	struct pantryfs_dir_bloom *bloom;
+
+	bloom = rcu_dereference_protected(pi->bloom,
+		lockdep_is_held(&sbh->bloom_lock));
+	if (bloom) {
+		list_del(&bloom->list);
+		RCU_INIT_POINTER(pi->bloom, NULL);
+		sbh->nr_blooms--;
+	}
+	return bloom;
+}
+
+/* Forget the name filter of directory @dir, if it has one. */
+static void pantryfs_bloom_drop(struct inode *dir)
+{
+	struct pantryfs_sb_buffer_heads *sbh = PFS_SB(dir->i_sb);
+	struct pantryfs_dir_bloom *bloom;
+
+	if (!rcu_access_pointer(PFS_I(dir)->bloom))
+		return;
+
+	spin_lock(&sbh->bloom_lock);
+	bloom = pantryfs_bloom_detach(sbh, PFS_I(dir));
+	spin_unlock(&sbh->bloom_lock);
+	if (bloom)
+		call_rcu(&bloom->rcu, pantryfs_bloom_free);
+}
+
+/**
+ * Build a name filter for directory @dir from its blocks, sized for twice the
+ * entries it holds now. The blocks are walked twice, once to count the
+ * entries and once to hash them; the second pass finds them in the cache.
+ */
+static struct pantryfs_dir_bloom *pantryfs_bloom_build(struct inode *dir)
+{
+	struct pantryfs_dir_bloom *bloom = NULL;
+	struct pantryfs_dir_entry *de;
+	struct buffer_head *bh;
+	uint32_t lblk, nblocks;
+	unsigned int nr = 0, shift;
+	char *end;
+	int pass;
+
+	nblocks = i_size_read(dir) >> dir->i_sb->s_blocksize_bits;
+	for (pass = 0; pass < 2; pass++) {
+		for (lblk = 0; lblk < nblocks; lblk++) {
+			bh = pantryfs_dir_bread(dir, lblk);
+			if (IS_ERR(bh)) {
+				kvfree(bloom);
+				return ERR_CAST(bh);
+			}
+
+			de = (struct pantryfs_dir_entry *) bh->b_data;
+			end = bh->b_data + PFS_BLOCK_SIZE;
+			for (; (char *) de < end; de = pantryfs_next_entry(de)) {
+				if (pantryfs_check_entry(dir, bh, de)) {
+					brelse(bh);
+					kvfree(bloom);
+					return ERR_PTR(-EIO);
+				}
+				if (!de->inode_no)
+					continue;
+				if (bloom)
+					pantryfs_bloom_add(bloom, de->filename,
+						de->name_len);
+				else
+					nr++;
+			}
+			brelse(bh);
+		}
+		if (bloom)
+			break;
+
+		nr = max(2 * nr, PANTRYFS_BLOOM_MIN_NAMES);
+		shift = min(ilog2(roundup_pow_of_two(nr *
+				PANTRYFS_BLOOM_BITS_PER_NAME)),
+			PANTRYFS_BLOOM_MAX_SHIFT);
+		bloom = kvzalloc(struct_size(bloom, map,
+				BITS_TO_LONGS(1UL << shift)), GFP_KERNEL);
+		if (!bloom)
+			return ERR_PTR(-ENOMEM);
+		bloom->bits_shift = shift;
+		bloom->limit = nr;
+	}
+	return bloom;
+}
+
+/**
+ * Whether @name is certainly not in directory @dir, answered from the
+ * directory's name filter, which is built here on the first lookup. Called
+ * with i_rwsem held at least shared, so the entries cannot change under the
+ * build.
+ */
+static bool pantryfs_bloom_miss(struct inode *dir, const struct qstr *name)
+{
+	struct pantryfs_sb_buffer_heads *sbh = PFS_SB(dir->i_sb);
+	struct pantryfs_inode_info *pi = PFS_I(dir);
+	struct pantryfs_dir_bloom *bloom;
+	bool miss;
+
+	rcu_read_lock();
+	bloom = rcu_dereference(pi->bloom);
+	if (bloom) {
+		miss = !pantryfs_bloom_test(bloom, name->name, name->len);
+		rcu_read_unlock();
+		return miss;
+	}
+	rcu_read_unlock();
+
+	/* Errors are left to the lookup proper to report. */
+	bloom = pantryfs_bloom_build(dir);
+	if (IS_ERR(bloom))
+		return false;
+	miss = !pantryfs_bloom_test(bloom, name->name, name->len);
+
+	/* A parallel lookup may have got there first. */
+	spin_lock(&sbh->bloom_lock);
+	if (!rcu_access_pointer(pi->bloom)) {
+		bloom->owner = pi;
+		list_add_tail(&bloom->list, &sbh->bloom_list);
+		sbh->nr_blooms++;
+		rcu_assign_pointer(pi->bloom, bloom);
+		bloom = NULL;
+	}
+	spin_unlock(&sbh->bloom_lock);
+	kvfree(bloom);
+	return miss;
+}
+
+/* Note @name, just added to directory @dir, in the directory's name filter.
+ * Removed names are never cleared, so once more names have been added than
+ * the filter was sized for, it is dropped and rebuilt by a later lookup.
+ */
+static void pantryfs_bloom_note(struct inode *dir, const struct qstr *name)
+{
+	struct pantryfs_dir_bloom *bloom;
+	bool full = false;
+
+	rcu_read_lock();
+	bloom = rcu_dereference(PFS_I(dir)->bloom);
+	if (bloom) {
+		pantryfs_bloom_add(bloom, name->name, name->len);
+		full = ++bloom->added > bloom->limit / 2;
+	}
+	rcu_read_unlock();
+	if (full)
+		pantryfs_bloom_drop(dir);
+}
+
+long pantryfs_nr_cached_objects(struct super_block *sb,
+		struct shrink_control *sc)
+{
+	return READ_ONCE(PFS_SB(sb)->nr_blooms);
+}
+
+/* Free up to sc->nr_to_scan name filters, oldest first. */
+long pantryfs_free_cached_objects(struct super_block *sb,
+		struct shrink_control *sc)
+{
+	struct pantryfs_sb_buffer_heads *sbh = PFS_SB(sb);
+	struct pantryfs_dir_bloom *bloom;
+	long freed = 0;
+
+	while (freed < sc->nr_to_scan) {
+		spin_lock(&sbh->bloom_lock);
+		bloom = list_first_entry_or_null(&sbh->bloom_list,
+			struct pantryfs_dir_bloom, list);
+		if (bloom)
+			pantryfs_bloom_detach(sbh, bloom->owner);
+		spin_unlock(&sbh->bloom_lock);
+		if (!bloom)
+			break;
+		call_rcu(&bloom->rcu, pantryfs_bloom_free);
+		freed++;
+	}
+	return freed;
+}
+
+/**
+ * Add an entry for @inode named @name to directory @dir. Linear
+ * directories grow a block at a time, except that a full single-block
+ * directory is converted to the indexed layout if the filesystem supports
+ * it.
+ */
+static int pantryfs_add_entry(struct inode *dir, const struct qstr *name,
+		struct inode *inode)
+{
+	struct buffer_head *bh;
+	uint32_t lblk, nblocks;
+	int ret = -ENOSPC;
+
+	if (PFS_INODE(dir)->flags & PANTRYFS_INDEX_FL) {
+		ret = pantryfs_dx_add_entry(dir, name, inode);
+		goto out;
+	}
+
+	nblocks = i_size_read(dir) >> dir->i_sb->s_blocksize_bits;
+	for (lblk = 0; lblk < nblocks && ret == -ENOSPC; lblk++) {
+		bh = pantryfs_dir_bread(dir, lblk);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		ret = pantryfs_insert_in_block(dir, bh, name, inode);
+		brelse(bh);
+	}
+	if (ret != -ENOSPC)
+		goto out;
+
+	if (nblocks == 1 &&
+	    PFS_DISK_SB(dir->i_sb)->features & PANTRYFS_FEATURE_DIR_INDEX) {
+		ret = pantryfs_dx_make_indexed(dir);
+		if (!ret)
+			ret = pantryfs_dx_add_entry(dir, name, inode);
+		goto out;
+	}
+
+	bh = pantryfs_dir_append(dir, &lblk);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	ret = pantryfs_insert_in_block(dir, bh, name, inode);
+	brelse(bh);
+out:
+	if (ret)
+		return ret;
+	pantryfs_bloom_note(dir, name);
+	inode_inc_iversion(dir);
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+/**
+ * Look @name up in directory @dir. Returns the buffer_head of the block
+ * holding the entry, with *@res_de pointing at the entry, NULL if there is
+ * no such entry, or an ERR_PTR.
+ */
+static struct buffer_head *pantryfs_find_entry(struct inode *dir,
+		const struct qstr *name, struct pantryfs_dir_entry **res_de)
+{
+	struct pantryfs_dx_frame frames[PANTRYFS_DX_MAX_LEVELS + 1];
+	struct pantryfs_dir_entry *de;
+	struct buffer_head *bh;
+	uint32_t lblk, nblocks;
+	int nframes, ret;
+
+	if (PFS_INODE(dir)->flags & PANTRYFS_INDEX_FL) {
+		ret = pantryfs_dx_probe(dir,
+			pantryfs_name_hash(name->name, name->len),
+			frames, &nframes);
+		if (ret < 0)
+			return ERR_PTR(ret);
+		pantryfs_dx_release(frames, nframes);
+		lblk = ret;
+		nblocks = lblk + 1;
+	} else {
+		lblk = 0;
+		nblocks = i_size_read(dir) >> dir->i_sb->s_blocksize_bits;
+	}
+
+	for (; lblk < nblocks; lblk++) {
+		bh = pantryfs_dir_bread(dir, lblk);
+		if (IS_ERR(bh))
+			return bh;
+
+		de = pantryfs_search_block(dir, bh, name);
+		if (de && !IS_ERR(de)) {
+			*res_de = de;
+			return bh;
+		}
+		brelse(bh);
+		if (IS_ERR(de))
+			return ERR_CAST(de);
+	}
+	return NULL;
+}
+
+/* Whether directory @dir holds no entries. Index blocks look empty. */
+static int pantryfs_dir_empty(struct inode *dir)
+{
+	struct pantryfs_dir_entry *de;
+	struct buffer_head *bh;
+	uint32_t lblk, nblocks;
+	char *end;
+
+	nblocks = i_size_read(dir) >> dir->i_sb->s_blocksize_bits;
+	for (lblk = 0; lblk < nblocks; lblk++) {
+		bh = pantryfs_dir_bread(dir, lblk);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+
+		de = (struct pantryfs_dir_entry *) bh->b_data;
+		end = bh->b_data + PFS_BLOCK_SIZE;
+		for (; (char *) de < end; de = pantryfs_next_entry(de)) {
+			if (pantryfs_check_entry(dir, bh, de) || de->inode_no) {
+				brelse(bh);
+				return 0;
+			}
+		}
+		brelse(bh);
+	}
+	return 1;
+}
+
+int pantryfs_dir_open(struct inode *inode, struct file *filp)
+{
+	struct pantryfs_dir_cursor *cursor;
+
+	cursor = kmalloc(sizeof(*cursor), GFP_KERNEL);
+	if (!cursor)
+		return -ENOMEM;
+	cursor->pos = -1;
+	cursor->last_pos = -1;
+	filp->private_data = cursor;
+	return 0;
+}
+
+int pantryfs_dir_release(struct inode *inode, struct file *filp)
+{
+	kfree(filp->private_data);
+	return 0;
+}
+
+/* Walk directory @dir from ctx->pos. Runs under a shared i_rwsem: entries
+ * only change with it held exclusively, and the extent map has its own lock,
+ * so nothing here writes to the directory. Readers of one struct file are
+ * serialised by its f_pos_lock, which covers the cursor.
+ */
+static int pantryfs_readdir(struct inode *dir, struct pantryfs_dir_cursor *cursor,
+		struct dir_context *ctx)
+{
+	struct pantryfs_dir_entry *de;
+	struct buffer_head *bh;
+	unsigned int offset;
+	uint32_t lblk;
+	bool valid;
+	char *end;
+
+	/* Past the dots, ctx->pos - 2 is the byte offset of the next entry in
+	 * the directory. The cursor remembers the position the last call
+	 * stopped at, which is the start of a record unless the directory has
+	 * changed since. Any other position may point into the middle of a
+	 * record after a seekdir(), so its block is walked from the start.
+	 */
+	valid = ctx->pos == cursor->pos &&
+		inode_eq_iversion(dir, cursor->version);
+
+	while (ctx->pos - 2 < i_size_read(dir)) {
+		lblk = (ctx->pos - 2) >> dir->i_sb->s_blocksize_bits;
+		offset = (ctx->pos - 2) & (PFS_BLOCK_SIZE - 1);
+
+		bh = pantryfs_dir_bread(dir, lblk);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+
+		de = (struct pantryfs_dir_entry *) bh->b_data;
+		if (valid)
+			de = (struct pantryfs_dir_entry *) (bh->b_data + offset);
+		end = bh->b_data + PFS_BLOCK_SIZE;
+		for (; (char *) de < end; de = pantryfs_next_entry(de)) {
+			if (pantryfs_check_entry(dir, bh, de)) {
+				brelse(bh);
+				return -EIO;
+			}
+			if (!de->inode_no || (char *) de - bh->b_data < offset)
+				continue;
+
+			ctx->pos = 2 + ((loff_t) lblk << dir->i_sb->s_blocksize_bits) +
+				((char *) de - bh->b_data);
+			if (!dir_emit(ctx, de->filename, de->name_len,
+					de->inode_no,
+					fs_ftype_to_dtype(de->file_type))) {
+				brelse(bh);
+				return 0;
+			}
+		}
+		brelse(bh);
+		ctx->pos = 2 + ((loff_t) (lblk + 1) << dir->i_sb->s_blocksize_bits);
+		valid = true;
+	}
+	return 0;
+}
+
+/* Whether the directories of @sb are read in hash order. */
+static bool pantryfs_dir_hashed(struct super_block *sb)
+{
+	return PFS_DISK_SB(sb)->features & PANTRYFS_FEATURE_DIR_INDEX;
+}
+
+/* Whether readdir positions handed out through @filp must fit in 32 bits.
+ * nfsd says so through f_mode; otherwise it depends on the syscall ABI.
+ */
+static bool pantryfs_dir_pos32(struct file *filp)
+{
+	if (filp->f_mode & FMODE_32BITHASH)
+		return true;
+	if (filp->f_mode & FMODE_64BITHASH)
+		return false;
+#ifdef CONFIG_COMPAT
+	return in_compat_syscall();
+#else
+	return BITS_PER_LONG == 32;
+#endif
+}
+
+static loff_t pantryfs_dir_hash_eof(struct file *filp)
+{
+	return pantryfs_dir_pos32(filp) ? PANTRYFS_DIR_HASH_EOF_32BIT :
+		PANTRYFS_DIR_HASH_EOF;
+}
+
+/* Readdir position of a name with index hash @hash. A 64-bit position has
+ * 30 bits of a second hash below the index hash, so that names sharing the
+ * index hash are still told apart. A 32-bit one has the index hash alone.
+ */
+static loff_t pantryfs_hash_pos(const void *name, unsigned int len,
+		uint32_t hash, bool pos32)
+{
+	if (pos32)
+		return 2 + (hash >> PANTRYFS_DIR_POS32_SHIFT);
+	return 2 + ((loff_t) hash << PANTRYFS_DIR_MINOR_BITS |
+		jhash(name, len, 0) >> (32 - PANTRYFS_DIR_MINOR_BITS));
+}
+
+/* The lowest index hash a name at readdir position @pos or later can have,
+ * or more than U32_MAX if there is none.
+ */
+static uint64_t pantryfs_pos_hash(loff_t pos, bool pos32)
+{
+	if (pos32 && pos - 2 > U32_MAX >> PANTRYFS_DIR_POS32_SHIFT)
+		return (uint64_t) U32_MAX + 1;
+	if (pos32)
+		return (uint64_t) (pos - 2) << PANTRYFS_DIR_POS32_SHIFT;
+	return (uint64_t) (pos - 2) >> PANTRYFS_DIR_MINOR_BITS;
+}
+
+/* A name of a leaf being listed, in readdir order. */
+struct pantryfs_readdir_map {
+	loff_t pos;
+	uint32_t hash;
+	struct pantryfs_dir_entry *de;
+};
+
+static int pantryfs_name_cmp(const char *a, unsigned int alen,
+		const char *b, unsigned int blen)
+{
+	int ret = memcmp(a, b, min(alen, blen));
+
+	return ret ? ret : (int) alen - (int) blen;
+}
+
+/* Order of names sharing a readdir position: by index hash, then by name. */
+static int pantryfs_readdir_tie_cmp(uint32_t ahash, const char *a,
+		unsigned int alen, uint32_t bhash, const char *b,
+		unsigned int blen)
+{
+	if (ahash != bhash)
+		return ahash < bhash ? -1 : 1;
+	return pantryfs_name_cmp(a, alen, b, blen);
+}
+
+static int pantryfs_readdir_map_cmp(const void *a, const void *b)
+{
+	const struct pantryfs_readdir_map *x = a, *y = b;
+
+	if (x->pos != y->pos)
+		return x->pos < y->pos ? -1 : 1;
+	return pantryfs_readdir_tie_cmp(x->hash, x->de->filename,
+		x->de->name_len, y->hash, y->de->filename, y->de->name_len);
+}
+
+/**
+ * List the entries of leaf @lblk of @dir whose position is at or past
+ * @start. Returns 1 once they are all listed, 0 if the caller's buffer
+ * filled up first, or a negative errno.
+ *
+ * Names sharing a position are listed by hash and then by name. A 32-bit
+ * position can even be shared by names in neighbouring leaves. When the
+ * buffer fills up among them, the cursor records the last name listed, so
+ * that the next call, which starts over at the same position, skips the
+ * names up to it. @resume says whether this call is such a one.
+ */
+static int pantryfs_readdir_leaf(struct inode *dir, uint32_t lblk,
+		loff_t start, bool resume, bool pos32,
+		struct pantryfs_dir_cursor *cursor, struct dir_context *ctx,
+		struct pantryfs_readdir_map *map)
+{
+	struct pantryfs_dir_entry *de;
+	struct buffer_head *bh;
+	unsigned int nr = 0, i;
+	uint32_t hash;
+	loff_t pos;
+	char *bend;
+
+	bh = pantryfs_dir_bread(dir, lblk);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	de = (struct pantryfs_dir_entry *) bh->b_data;
+	bend = bh->b_data + PFS_BLOCK_SIZE;
+	for (; (char *) de < bend; de = pantryfs_next_entry(de)) {
+		if (pantryfs_check_entry(dir, bh, de)) {
+			brelse(bh);
+			return -EIO;
+		}
+		if (!de->inode_no)
+			continue;
+		hash = pantryfs_name_hash(de->filename, de->name_len);
+		pos = pantryfs_hash_pos(de->filename, de->name_len, hash, pos32);
+		if (pos < start)
+			continue;
+		if (resume && pos == start &&
+		    pantryfs_readdir_tie_cmp(hash, de->filename, de->name_len,
+			    cursor->last_hash, cursor->last_name,
+			    cursor->last_len) <= 0)
+			continue;
+		map[nr].pos = pos;
+		map[nr].hash = hash;
+		map[nr++].de = de;
+	}
+	sort(map, nr, sizeof(*map), pantryfs_readdir_map_cmp, NULL);
+
+	for (i = 0; i < nr; i++) {
+		de = map[i].de;
+		ctx->pos = map[i].pos;
+		if (!dir_emit(ctx, de->filename, de->name_len, de->inode_no,
+				fs_ftype_to_dtype(de->file_type))) {
+			brelse(bh);
+			return 0;
+		}
+		cursor->last_pos = map[i].pos;
+		cursor->last_hash = map[i].hash;
+		cursor->last_len = de->name_len;
+		memcpy(cursor->last_name, de->filename, de->name_len);
+	}
+	brelse(bh);
+	return 1;
+}
+
+/**
+ * Walk directory @dir in hash order from ctx->pos, as for pantryfs_readdir().
+ * Past the dots, a position names a point in hash order rather than a place
+ * in the directory's blocks, which entries move between when a leaf is split
+ * or the directory becomes indexed. A listing that runs across those changes
+ * still sees every entry that was there all along exactly once.
+ */
+static int pantryfs_readdir_hashed(struct inode *dir, bool pos32,
+		struct pantryfs_dir_cursor *cursor, struct dir_context *ctx)
+{
+	struct pantryfs_dx_frame frames[PANTRYFS_DX_MAX_LEVELS + 1];
+	struct pantryfs_dx_frame *frame;
+	struct pantryfs_readdir_map *map;
+	loff_t start = ctx->pos;
+	uint64_t hash, next;
+	int nframes, ret = 0;
+	uint32_t lblk;
+	bool resume;
+
+	map = kmalloc_array(PFS_BLOCK_SIZE / PANTRYFS_DIR_REC_LEN(1),
+		sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return -ENOMEM;
+
+	/* Pick up after the last name listed if the last call stopped among
+	 * names sharing its position. The leaves are walked in hash order from
+	 * the one holding the first name still to be listed.
+	 */
+	resume = cursor->pos == start && cursor->last_pos == start;
+	hash = resume ? cursor->last_hash : pantryfs_pos_hash(start, pos32);
+
+	while (hash <= U32_MAX) {
+		/* The leaf covering hash, and where the next one starts. */
+		next = (uint64_t) U32_MAX + 1;
+		if (PFS_INODE(dir)->flags & PANTRYFS_INDEX_FL) {
+			ret = pantryfs_dx_probe(dir, hash, frames, &nframes);
+			if (ret < 0)
+				goto out;
+			lblk = ret;
+			for (frame = &frames[nframes - 1]; frame >= frames; frame--) {
+				if (frame->at + 1 < frame->dx->count) {
+					next = frame->dx->entries[frame->at + 1].hash;
+					break;
+				}
+			}
+			pantryfs_dx_release(frames, nframes);
+		} else if (i_size_read(dir) == PFS_BLOCK_SIZE) {
+			/* Directories outgrowing a block become indexed. */
+			lblk = 0;
+		} else if (i_size_read(dir)) {
+			ret = -EIO;
+			goto out;
+		} else {
+			break;
+		}
+
+		ret = pantryfs_readdir_leaf(dir, lblk, start, resume, pos32,
+			cursor, ctx, map);
+		if (ret <= 0)
+			goto out;
+		hash = next;
+	}
+	ctx->pos = pos32 ? PANTRYFS_DIR_HASH_EOF_32BIT : PANTRYFS_DIR_HASH_EOF;
+	ret = 0;
+out:
+	kfree(map);
+	return ret;
+}
+
+int pantryfs_iterate_shared(struct file *filp, struct dir_context *ctx)
+{
+	struct pantryfs_dir_cursor *cursor = filp->private_data;
+	struct inode *dir = file_inode(filp);
+	int ret;
+
+	if (!dir_emit_dots(filp, ctx))
+		return 0;
+
+	if (pantryfs_dir_hashed(dir->i_sb))
+		ret = pantryfs_readdir_hashed(dir, pantryfs_dir_pos32(filp),
+			cursor, ctx);
+	else
+		ret = pantryfs_readdir(dir, cursor, ctx);
+	cursor->pos = ctx->pos;
+	cursor->version = inode_query_iversion(dir);
+	return ret;
+}
+
+/* Positions in hash order run past the directory's size. */
+loff_t pantryfs_dir_llseek(struct file *filp, loff_t offset, int whence)
+{
+	loff_t eof;
+
+	if (!pantryfs_dir_hashed(file_inode(filp)->i_sb))
+		return generic_file_llseek(filp, offset, whence);
+	eof = pantryfs_dir_hash_eof(filp);
+	return generic_file_llseek_size(filp, offset, whence, eof, eof);
+}
+
+int pantryfs_open(struct inode *inode, struct file *filp)
+{
+	unsigned long ra_pages = READ_ONCE(stream_ra_kb) >> (PAGE_SHIFT - 10);
+
+	/* Each readahead round pays for walking the page cache, mapping the
+	 * range and building bios. If the administrator asks for it, a bigger
+	 * window for big files spreads that over more data. Devices with
+	 * readahead off are left alone.
+	 */
+	if (ra_pages && filp->f_ra.ra_pages &&
+	    i_size_read(inode) >= PANTRYFS_STREAM_MIN_SIZE)
+		filp->f_ra.ra_pages = max_t(unsigned long, filp->f_ra.ra_pages,
+			ra_pages);
+	return generic_file_open(inode, filp);
+}
+
+/* Find the first data (SEEK_DATA) or hole (SEEK_HOLE) at or after @offset.
+ * Unwritten extents count as holes, and EOF as the start of one.
+ */
+static loff_t pantryfs_seek_hole_data(struct inode *inode, loff_t offset,
+		int whence)
+{
+	unsigned int bits = inode->i_blkbits;
+	loff_t size = i_size_read(inode), pos = -ENXIO;
+	struct pantryfs_extent_map map;
+	struct pantryfs_extent *ext;
+	uint64_t lblk = offset >> bits;
+	int slot, ret;
+
+	if (offset < 0 || offset >= size)
+		return -ENXIO;
+	if (pantryfs_has_inline_data(inode))
+		return whence == SEEK_DATA ? offset : size;
+
+	/* Delayed blocks only show up in the extent map once written back. */
+	ret = filemap_write_and_wait(inode->i_mapping);
+	if (ret)
+		return ret;
+
+	down_read(&PFS_I(inode)->map_sem);
+	ret = pantryfs_ext_load(inode, &map);
+	if (ret) {
+		up_read(&PFS_I(inode)->map_sem);
+		return ret;
+	}
+
+	ret = pantryfs_ext_seek(&map, lblk, &slot);
+	if (!ret && slot < 0)
+		ret = pantryfs_ext_step(&map, &slot);
+	for (; !ret; ret = pantryfs_ext_step(&map, &slot)) {
+		ext = &map.ext[slot];
+		if (pantryfs_ext_end(ext) <= lblk ||
+		    pantryfs_ext_unwritten(ext))
+			continue;
+
+		if (whence == SEEK_DATA) {
+			pos = max_t(loff_t, offset,
+				(loff_t) ext->ee_block << bits);
+			break;
+		}
+		if (ext->ee_block > lblk)
+			break;
+		lblk = pantryfs_ext_end(ext);
+	}
+
+	pantryfs_ext_release(&map);
+	up_read(&PFS_I(inode)->map_sem);
+	if (ret < 0)
+		return ret;
+
+	if (whence == SEEK_HOLE)
+		return min_t(loff_t, size, max_t(loff_t, offset, lblk << bits));
+	return pos < size ? pos : -ENXIO;
+}
+
+loff_t pantryfs_llseek(struct file *filp, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(filp);
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return generic_file_llseek(filp, offset, whence);
+
+	inode_lock_shared(inode);
+	offset = pantryfs_seek_hole_data(inode, offset, whence);
+	inode_unlock_shared(inode);
+	if (offset < 0)
+		return offset;
+	return vfs_setpos(filp, offset, inode->i_sb->s_maxbytes);
+}
+
+int pantryfs_create(struct inode *parent, struct dentry *dentry, umode_t mode, bool excl)
+{
+	struct inode *inode;
+	int ret;
+
+	if (dentry->d_name.len > PANTRYFS_MAX_FILENAME_LENGTH)
+		return -ENAMETOOLONG;
+
+	inode = pantryfs_new_inode(parent, mode);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	ret = pantryfs_add_entry(parent, &dentry->d_name, inode);
+	if (ret) {
+		clear_nlink(inode);
+		discard_new_inode(inode);
+		return ret;
+	}
+
+	d_instantiate_new(dentry, inode);
+	return 0;
+}
+
+int pantryfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct pantryfs_dir_entry *de;
+	struct buffer_head *bh;
+	int ret;
+
+	bh = pantryfs_find_entry(dir, &dentry->d_name, &de);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	if (!bh)
+		return -ENOENT;
+
+	ret = pantryfs_delete_entry(dir, bh, de);
+	brelse(bh);
+	if (ret)
+		return ret;
+
+	dir->i_ctime = dir->i_mtime = current_time(dir);
+	mark_inode_dirty(dir);
+
+	inode->i_ctime = dir->i_ctime;
+	drop_nlink(inode);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+int pantryfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pantryfs_inode *pfs_inode = PFS_INODE(inode);
+	struct buffer_head *bh;
+	unsigned int slot;
+	int ret = 0;
+
+	bh = sb_bread(sb, pantryfs_inode_block(sb, inode->i_ino, &slot));
+	if (!bh)
+		return -EIO;
+
+	down_write(&PFS_I(inode)->map_sem);
+	pfs_inode->mode = inode->i_mode;
+	pfs_inode->uid = i_uid_read(inode);
+	pfs_inode->gid = i_gid_read(inode);
+	pfs_inode->nlink = inode->i_nlink;
+	pfs_inode->i_atime = inode->i_atime;
+	pfs_inode->i_mtime = inode->i_mtime;
+	pfs_inode->i_ctime = inode->i_ctime;
+	pfs_inode->file_size = i_size_read(inode);
+
+	/* The buffer lock serialises the inodes sharing this table block, and
+	 * keeps the record from being written out half copied.
+	 */
+	lock_buffer(bh);
+	memcpy((struct pantryfs_inode *) bh->b_data + slot, pfs_inode,
+		sizeof(*pfs_inode));
+	unlock_buffer(bh);
+	up_write(&PFS_I(inode)->map_sem);
+	mark_buffer_dirty(bh);
+
+	if (wbc->sync_mode == WB_SYNC_ALL) {
+		sync_dirty_buffer(bh);
+		if (buffer_req(bh) && !buffer_uptodate(bh))
+			ret = -EIO;
+	}
+	brelse(bh);
+	return ret;
+}
+
+void pantryfs_evict_inode(struct inode *inode)
+{
+	bool delete = !inode->i_nlink && !is_bad_inode(inode);
+
+	/* Required to be called by VFS. If not called, evict() will BUG out.*/
+	truncate_inode_pages_final(&inode->i_data);
+	if (delete)
+		pantryfs_ext_truncate(inode, 0);
+	if (S_ISDIR(inode->i_mode))
+		pantryfs_bloom_drop(inode);
+	invalidate_inode_buffers(inode);
+	clear_inode(inode);
+
+	if (delete)
+		pantryfs_free_ino(inode->i_sb, inode->i_ino,
+			S_ISDIR(inode->i_mode));
+}
+
+int pantryfs_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+	/* Writes back the page cache, then the extent blocks tied to the inode
+	 * with mark_buffer_dirty_inode().
+	 */
+	return generic_file_fsync(filp, start, end, datasync);
+}
+
+int pantryfs_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+
+	if (pantryfs_has_inline_data(inode)) {
+		pantryfs_inline_fill_page(inode, page);
+		unlock_page(page);
+		return 0;
+	}
+	return mpage_readpage(page, pantryfs_get_block);
+}
+
+void pantryfs_readahead(struct readahead_control *rac)
 {
-	return -EPERM;
+	/* Leaving the pages unread makes the VFS fall back to ->readpage. */
+	if (pantryfs_has_inline_data(rac->mapping->host))
+		return;
+	mpage_readahead(rac, pantryfs_get_block);
 }
 
-ssize_t pantryfs_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos)
+/* Give the dirty delayed buffer @bh, for block @lblk of @inode, its block. */
+static int pantryfs_wb_alloc(struct inode *inode, uint64_t lblk,
+		struct buffer_head *bh)
 {
-	return -EPERM;
+	int ret = pantryfs_get_block(inode, lblk, bh, 1);
+
+	if (ret)
+		return ret;
+	clear_buffer_delay(bh);
+	if (buffer_new(bh)) {
+		clear_buffer_new(bh);
+		clean_bdev_bh_alias(bh);
+	}
+	return 0;
 }
 
-loff_t pantryfs_llseek(struct file *filp, loff_t offset, int whence)
+/**
+ * Write @page with block_write_full_page(). Its delayed buffers inside EOF are
+ * given blocks first, as pantryfs_wb_page() does, so that those landing in
+ * preallocated space are known too. The buffers written to unwritten blocks
+ * have their blocks converted once the page's I/O has been sent.
+ */
+static int pantryfs_write_full_page(struct page *page,
+		struct writeback_control *wbc)
 {
-	return -EPERM;
+	struct inode *inode = page->mapping->host;
+	unsigned int bits = inode->i_blkbits;
+	uint64_t lblk = (uint64_t) page->index << (PAGE_SHIFT - bits);
+	uint64_t last = DIV_ROUND_UP(i_size_read(inode), PFS_BLOCK_SIZE);
+	struct buffer_head *head, *bh;
+	unsigned long unwritten = 0;
+	unsigned int i = 0;
+	int ret;
+
+	if (page_has_buffers(page)) {
+		head = bh = page_buffers(page);
+		do {
+			/* A failure here is met again, and reported, by
+			 * block_write_full_page().
+			 */
+			if (lblk + i < last && buffer_dirty(bh)) {
+				if (buffer_delay(bh))
+					pantryfs_wb_alloc(inode, lblk + i, bh);
+				if (buffer_unwritten(bh)) {
+					clear_buffer_unwritten(bh);
+					unwritten |= BIT(i);
+				}
+			}
+			bh = bh->b_this_page;
+			i++;
+		} while (bh != head);
+	}
+
+	ret = block_write_full_page(page, pantryfs_get_block, wbc);
+	for (i = 0; !ret && unwritten >> i; i++) {
+		if (unwritten & BIT(i))
+			ret = pantryfs_convert_unwritten(inode, lblk + i,
+				lblk + i + 1);
+	}
+	return ret;
 }
 
-int pantryfs_create(struct inode *parent, struct dentry *dentry, umode_t mode, bool excl)
+int pantryfs_writepage(struct page *page, struct writeback_control *wbc)
 {
-	return -EPERM;
+	struct inode *inode = page->mapping->host;
+
+	/* A page of an inline file is only dirtied through a shared mapping.
+	 * Its data belongs in the inode, which write_inode() stores.
+	 */
+	if (pantryfs_has_inline_data(inode)) {
+		if (!page->index) {
+			/* Keep the part past EOF reading as zeros, as the
+			 * block writeback paths do.
+			 */
+			zero_user_segment(page, i_size_read(inode), PAGE_SIZE);
+			pantryfs_inline_store_page(inode, page);
+		}
+		unlock_page(page);
+		return 0;
+	}
+	return pantryfs_write_full_page(page, wbc);
 }
 
-int pantryfs_unlink(struct inode *dir, struct dentry *dentry)
+/* State carried across the pages of one pantryfs_writepages() call. */
+struct pantryfs_wb_ctx {
+	struct inode *inode;
+	struct bio *bio;
+	sector_t next_block;	/* Device block that would extend @bio */
+
+	/* Unwritten blocks sent, or about to be sent, in @bio, which are to
+	 * be converted once it has been submitted.
+	 */
+	uint64_t conv_from, conv_end;
+};
+
+static void pantryfs_end_bio_write(struct bio *bio)
 {
-	return -EPERM;
+	int err = blk_status_to_errno(bio->bi_status);
+	struct bvec_iter_all iter_all;
+	struct bio_vec *bvec;
+
+	bio_for_each_segment_all(bvec, bio, iter_all) {
+		struct page *page = bvec->bv_page;
+
+		if (err) {
+			SetPageError(page);
+			mapping_set_error(page->mapping, err);
+		}
+		end_page_writeback(page);
+	}
+	bio_put(bio);
 }
 
-int pantryfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+static void pantryfs_wb_submit(struct pantryfs_wb_ctx *ctx)
 {
-	return -EPERM;
+	int err;
+
+	if (ctx->bio) {
+		submit_bio(ctx->bio);
+		ctx->bio = NULL;
+	}
+	if (ctx->conv_end > ctx->conv_from) {
+		err = pantryfs_convert_unwritten(ctx->inode, ctx->conv_from,
+			ctx->conv_end);
+		if (err)
+			mapping_set_error(ctx->inode->i_mapping, err);
+		ctx->conv_from = ctx->conv_end = 0;
+	}
 }
 
-void pantryfs_evict_inode(struct inode *inode)
+/**
+ * write_cache_pages() callback. Appends @page to the bio being built if its
+ * block follows on from the previous page's, and starts a new bio otherwise.
+ * Pages whose block is not simply mapped and dirty (unallocated, partially
+ * dirty or smaller than a page) are written by block_write_full_page().
+ */
+static int pantryfs_wb_page(struct page *page, struct writeback_control *wbc,
+		void *data)
 {
-	/* Required to be called by VFS. If not called, evict() will BUG out.*/
-	truncate_inode_pages_final(&inode->i_data);
-	clear_inode(inode);
+	struct pantryfs_wb_ctx *ctx = data;
+	struct inode *inode = page->mapping->host;
+	struct pantryfs_sb_buffer_heads *sbh = PFS_SB(inode->i_sb);
+	loff_t size = i_size_read(inode);
+	pgoff_t end_index = size >> PAGE_SHIFT;
+	unsigned int tail = size & ~PAGE_MASK;
+	struct buffer_head *bh;
+	int ret;
+
+	if (inode->i_blkbits != PAGE_SHIFT || !page_has_buffers(page))
+		goto confused;
+	bh = page_buffers(page);
+	if (page->index > end_index || (page->index == end_index && !tail))
+		goto confused;
+
+	/* Allocate delayed blocks in file order, each one right after the
+	 * last, so that the run keeps growing.
+	 */
+	if (buffer_delay(bh) && buffer_dirty(bh) &&
+	    pantryfs_wb_alloc(inode, page->index, bh))
+		goto confused;
+	if (!buffer_mapped(bh) || !buffer_dirty(bh))
+		goto confused;
+
+	if (ctx->bio && bh->b_blocknr != ctx->next_block)
+		pantryfs_wb_submit(ctx);
+	/* Unwritten blocks are converted in runs of file order. */
+	if (buffer_unwritten(bh) && ctx->conv_end > ctx->conv_from &&
+	    page->index != ctx->conv_end)
+		pantryfs_wb_submit(ctx);
+
+	/* The part of the last page past EOF may be mapped; zero it. */
+	if (page->index == end_index)
+		zero_user_segment(page, tail, PAGE_SIZE);
+
+	clear_buffer_dirty(bh);
+	set_page_writeback(page);
+	unlock_page(page);
+
+	do {
+		if (!ctx->bio) {
+			ctx->bio = bio_alloc(GFP_NOFS, BIO_MAX_PAGES);
+			bio_set_dev(ctx->bio, bh->b_bdev);
+			ctx->bio->bi_iter.bi_sector =
+				bh->b_blocknr << (inode->i_blkbits - 9);
+			ctx->bio->bi_opf = REQ_OP_WRITE |
+				wbc_to_write_flags(wbc);
+			ctx->bio->bi_end_io = pantryfs_end_bio_write;
+			wbc_init_bio(wbc, ctx->bio);
+			percpu_counter_inc(&sbh->wb_bios);
+		}
+		if (bio_add_page(ctx->bio, page, PAGE_SIZE, 0) == PAGE_SIZE)
+			break;
+		pantryfs_wb_submit(ctx);
+	} while (1);
+
+	if (buffer_unwritten(bh)) {
+		clear_buffer_unwritten(bh);
+		if (ctx->conv_end == ctx->conv_from)
+			ctx->conv_from = page->index;
+		ctx->conv_end = page->index + 1;
+	}
+
+	wbc_account_cgroup_owner(wbc, page, PAGE_SIZE);
+	percpu_counter_inc(&sbh->wb_pages);
+	ctx->next_block = bh->b_blocknr + 1;
+	return 0;
+
+confused:
+	/* Left out of the statistics, which only cover the batched bios. */
+	pantryfs_wb_submit(ctx);
+	ret = pantryfs_write_full_page(page, wbc);
+	mapping_set_error(page->mapping, ret);
+	return ret;
 }
 
-int pantryfs_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+int pantryfs_writepages(struct address_space *mapping,
+		struct writeback_control *wbc)
+{
+	struct pantryfs_wb_ctx ctx = { .inode = mapping->host };
+	struct blk_plug plug;
+	int ret;
+
+	if (pantryfs_has_inline_data(mapping->host))
+		return generic_writepages(mapping, wbc);
+
+	blk_start_plug(&plug);
+	ret = write_cache_pages(mapping, wbc, pantryfs_wb_page, &ctx);
+	pantryfs_wb_submit(&ctx);
+	blk_finish_plug(&plug);
+	return ret;
+}
+
+void pantryfs_invalidatepage(struct page *page, unsigned int offset,
+		unsigned int length)
+{
+	unsigned int stop = offset + length, curr = 0, next;
+	struct buffer_head *head, *bh;
+	s64 released = 0;
+
+	/* Delayed buffers thrown away take their reservation with them. */
+	if (page_has_buffers(page)) {
+		head = bh = page_buffers(page);
+		do {
+			next = curr + bh->b_size;
+			if (next > stop)
+				break;
+			if (curr >= offset && buffer_delay(bh)) {
+				clear_buffer_delay(bh);
+				released++;
+			}
+			curr = next;
+			bh = bh->b_this_page;
+		} while (bh != head);
+		pantryfs_release_blocks(page->mapping->host->i_sb, released);
+	}
+
+	block_invalidatepage(page, offset, length);
+}
+
+/**
+ * Free the buffers of the clean page @page. A delayed buffer on a clean page
+ * was left over by a short copy and holds no data, but its reservation is
+ * still counted, so it is returned once the buffers are gone.
+ */
+int pantryfs_releasepage(struct page *page, gfp_t gfp)
+{
+	struct buffer_head *head, *bh;
+	s64 delayed = 0;
+
+	head = bh = page_buffers(page);
+	do {
+		if (buffer_delay(bh)) {
+			if (buffer_dirty(bh))
+				return 0;
+			delayed++;
+		}
+		bh = bh->b_this_page;
+	} while (bh != head);
+
+	if (!try_to_free_buffers(page))
+		return 0;
+	pantryfs_release_blocks(page->mapping->host->i_sb, delayed);
+	return 1;
+}
+
+/* Undo the effects of a failed write that extended the file to @to. */
+static void pantryfs_write_failed(struct address_space *mapping, loff_t to)
+{
+	struct inode *inode = mapping->host;
+
+	if (to > inode->i_size) {
+		truncate_pagecache(inode, inode->i_size);
+		pantryfs_ext_truncate(inode,
+			DIV_ROUND_UP(inode->i_size, PFS_BLOCK_SIZE));
+	}
+}
+
+int pantryfs_write_begin(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned int len, unsigned int flags,
+		struct page **pagep, void **fsdata)
+{
+	struct inode *inode = mapping->host;
+	struct page *page;
+	int ret;
+
+	if (pantryfs_has_inline_data(inode)) {
+		if (pos + len <= PANTRYFS_INLINE_DATA_SIZE) {
+			page = grab_cache_page_write_begin(mapping, 0, flags);
+			if (!page)
+				return -ENOMEM;
+			if (!PageUptodate(page))
+				pantryfs_inline_fill_page(inode, page);
+			*pagep = page;
+			return 0;
+		}
+
+		ret = pantryfs_inline_spill(inode);
+		if (ret)
+			return ret;
+	}
+
+	ret = block_write_begin(mapping, pos, len, flags, pagep,
+		pantryfs_get_block_delay);
+	if (ret < 0)
+		pantryfs_write_failed(mapping, pos + len);
+	return ret;
+}
+
+int pantryfs_write_end(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned int len, unsigned int copied,
+		struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+	int ret;
+
+	if (pantryfs_has_inline_data(inode)) {
+		if (pos + copied > inode->i_size)
+			i_size_write(inode, pos + copied);
+		pantryfs_inline_store_page(inode, page);
+		unlock_page(page);
+		put_page(page);
+		return copied;
+	}
+
+	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+	if (ret < len)
+		pantryfs_write_failed(mapping, pos + len);
+	return ret;
+}
+
+ssize_t pantryfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct address_space *mapping = iocb->ki_filp->f_mapping;
+	struct inode *inode = mapping->host;
+	loff_t end = iocb->ki_pos + iov_iter_count(iter);
+	ssize_t ret;
+
+	/* Inline data has no device block to transfer to or from. Doing
+	 * nothing makes the VFS complete the request through the page cache,
+	 * as it also does for writes that land in holes.
+	 */
+	if (pantryfs_has_inline_data(inode))
+		return 0;
+
+	ret = __blockdev_direct_IO(iocb, inode, inode->i_sb->s_bdev, iter,
+		pantryfs_get_block_dio, pantryfs_dio_end_io, NULL,
+		DIO_LOCKING | DIO_SKIP_HOLES);
+	if (ret < 0 && iov_iter_rw(iter) == WRITE)
+		pantryfs_write_failed(mapping, end);
+	return ret;
+}
+
+vm_fault_t pantryfs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct page *page = vmf->page;
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t ret = VM_FAULT_LOCKED;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+
+	/* Pages of an inline file need no block: pantryfs_writepage() copies
+	 * them back into the inode. The page lock keeps the data from being
+	 * spilled while we look.
+	 */
+	if (pantryfs_has_inline_data(inode)) {
+		lock_page(page);
+		if (page->mapping != inode->i_mapping) {
+			unlock_page(page);
+			ret = VM_FAULT_NOPAGE;
+			goto out;
+		}
+		if (pantryfs_has_inline_data(inode)) {
+			set_page_dirty(page);
+			wait_for_stable_page(page);
+			goto out;
+		}
+		unlock_page(page);
+	}
+
+	ret = block_page_mkwrite_return(block_page_mkwrite(vmf->vma, vmf,
+		pantryfs_get_block_delay));
+out:
+	sb_end_pagefault(inode->i_sb);
+	return ret;
+}
+
+int pantryfs_file_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	return -EPERM;
+	file_accessed(filp);
+	vma->vm_ops = &pantryfs_file_vm_ops;
+	return 0;
 }
 
-ssize_t pantryfs_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos)
+sector_t pantryfs_bmap(struct address_space *mapping, sector_t block)
 {
-	return -EPERM;
+	if (pantryfs_has_inline_data(mapping->host))
+		return 0;
+	/* Give delayed blocks their place on disk first. */
+	filemap_write_and_wait(mapping);
+	return generic_block_bmap(mapping, block, pantryfs_get_block);
 }
 
 struct dentry *pantryfs_lookup(struct inode *parent, struct dentry *child_dentry,
 		unsigned int flags)
 {
-	return NULL;
+	const struct qstr *name = &child_dentry->d_name;
+	struct pantryfs_dir_entry *de;
+	struct buffer_head *bh;
+	struct inode *inode = NULL;
+	uint64_t ino = 0;
+
+	if (name->len > PANTRYFS_MAX_FILENAME_LENGTH)
+		return ERR_PTR(-ENAMETOOLONG);
+
+	/* Most lookups of names that do not exist end here, without a block
+	 * read.
+	 */
+	if (pantryfs_bloom_miss(parent, name))
+		return d_splice_alias(NULL, child_dentry);
+
+	bh = pantryfs_find_entry(parent, name, &de);
+	if (IS_ERR(bh))
+		return ERR_CAST(bh);
+	if (bh) {
+		ino = de->inode_no;
+		brelse(bh);
+	}
+
+	if (ino) {
+		inode = pantryfs_iget(parent->i_sb, ino);
+		if (IS_ERR(inode))
+			return ERR_CAST(inode);
+	}
+	return d_splice_alias(inode, child_dentry);
 }
 
 int pantryfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 {
-	return -EPERM;
+	struct buffer_head *bh;
+	struct inode *inode;
+	uint32_t lblk;
+	int ret;
+
+	if (dentry->d_name.len > PANTRYFS_MAX_FILENAME_LENGTH)
+		return -ENAMETOOLONG;
+
+	inode = pantryfs_new_inode(dir, S_IFDIR | mode);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+	inc_nlink(inode);
+
+	/* Directories always have at least one block. */
+	bh = pantryfs_dir_append(inode, &lblk);
+	if (IS_ERR(bh)) {
+		ret = PTR_ERR(bh);
+		goto fail;
+	}
+	brelse(bh);
+
+	ret = pantryfs_add_entry(dir, &dentry->d_name, inode);
+	if (ret)
+		goto fail;
+
+	inc_nlink(dir);
+	mark_inode_dirty(dir);
+	d_instantiate_new(dentry, inode);
+	return 0;
+
+fail:
+	clear_nlink(inode);
+	discard_new_inode(inode);
+	return ret;
 }
 
 int pantryfs_rmdir(struct inode *dir, struct dentry *dentry)
 {
-	return -EPERM;
+	struct inode *inode = d_inode(dentry);
+	int ret;
+
+	ret = pantryfs_dir_empty(inode);
+	if (ret <= 0)
+		return ret ? ret : -ENOTEMPTY;
+
+	ret = pantryfs_unlink(dir, dentry);
+	if (ret)
+		return ret;
+
+	clear_nlink(inode);
+	drop_nlink(dir);
+	mark_inode_dirty(dir);
+	return 0;
 }
 
 int pantryfs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *dentry)
 {
-	return -EPERM;
+	struct inode *inode = d_inode(old_dentry);
+	int ret;
+
+	if (dentry->d_name.len > PANTRYFS_MAX_FILENAME_LENGTH)
+		return -ENAMETOOLONG;
+
+	inode->i_ctime = current_time(inode);
+	inode_inc_link_count(inode);
+	ihold(inode);
+
+	ret = pantryfs_add_entry(dir, &dentry->d_name, inode);
+	if (ret) {
+		inode_dec_link_count(inode);
+		iput(inode);
+		return ret;
+	}
+
+	d_instantiate(dentry, inode);
+	return 0;
 }
 
 int pantryfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 {
-	return -EPERM;
+	size_t len = strlen(symname) + 1;
+	struct inode *inode;
+	int ret;
+
+	if (dentry->d_name.len > PANTRYFS_MAX_FILENAME_LENGTH ||
+	    len > PFS_BLOCK_SIZE)
+		return -ENAMETOOLONG;
+
+	inode = pantryfs_new_inode(dir, S_IFLNK | 0777);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	if (len <= PANTRYFS_INLINE_DATA_SIZE) {
+		memcpy(PFS_INODE(inode)->inline_data, symname, len);
+		PFS_INODE(inode)->flags |= PANTRYFS_INLINE_DATA_FL;
+		pantryfs_set_ops(inode);
+		i_size_write(inode, len - 1);
+	} else {
+		/* Long targets go in a data block, read through the page cache. */
+		ret = page_symlink(inode, symname, len);
+		if (ret)
+			goto fail;
+	}
+	mark_inode_dirty(inode);
+
+	ret = pantryfs_add_entry(dir, &dentry->d_name, inode);
+	if (ret)
+		goto fail;
+
+	d_instantiate_new(dentry, inode);
+	return 0;
+
+fail:
+	clear_nlink(inode);
+	discard_new_inode(inode);
+	return ret;
 }
 
-const char *pantryfs_get_link(struct dentry *dentry, struct inode *inode, struct delayed_call *done)
+struct inode *pantryfs_alloc_inode(struct super_block *sb)
 {
-	return ERR_PTR(-EPERM);
+	struct pantryfs_inode_info *pi;
+
+	pi = kmem_cache_alloc(pantryfs_inode_cachep, GFP_KERNEL);
+	if (!pi)
+		return NULL;
+
+	/* New files start out with an empty on-disk record. */
+	memset(&pi->pfs, 0, sizeof(pi->pfs));
+	return &pi->vfs_inode;
 }
 
 /**
- * Called by VFS to free an inode. free_inode_nonrcu() must be called to free
- * the inode in the default manner.
+ * Called by VFS to free an inode, once RCU readers are done with it.
  *
  * @inode:	The inode that will be free'd by VFS.
  */
 void pantryfs_free_inode(struct inode *inode)
 {
-	free_inode_nonrcu(inode);
+	kmem_cache_free(pantryfs_inode_cachep, PFS_I(inode));
+}
+
+/* Change the size of @inode to @size, freeing blocks past the new end. */
+static int pantryfs_setsize(struct inode *inode, loff_t size)
+{
+	int ret;
+
+	/* Direct I/O in flight may still be writing to the blocks freed here. */
+	inode_dio_wait(inode);
+
+	if (pantryfs_has_inline_data(inode)) {
+		if (size <= PANTRYFS_INLINE_DATA_SIZE) {
+			truncate_setsize(inode, size);
+			down_write(&PFS_I(inode)->map_sem);
+			memset(PFS_INODE(inode)->inline_data + size, 0,
+				PANTRYFS_INLINE_DATA_SIZE - size);
+			up_write(&PFS_I(inode)->map_sem);
+			return 0;
+		}
+
+		ret = pantryfs_inline_spill(inode);
+		if (ret)
+			return ret;
+	}
+
+	/* Zero the tail of the new last block so it reads back as a hole
+	 * should the file grow again.
+	 */
+	ret = block_truncate_page(inode->i_mapping, size, pantryfs_get_block);
+	if (ret)
+		return ret;
+
+	truncate_setsize(inode, size);
+	return pantryfs_ext_truncate(inode, DIV_ROUND_UP(size, PFS_BLOCK_SIZE));
+}
+
+int pantryfs_setattr(struct dentry *dentry, struct iattr *iattr)
+{
+	struct inode *inode = d_inode(dentry);
+	int ret;
+
+	ret = setattr_prepare(dentry, iattr);
+	if (ret)
+		return ret;
+
+	if ((iattr->ia_valid & ATTR_SIZE) &&
+	    iattr->ia_size != i_size_read(inode)) {
+		ret = pantryfs_setsize(inode, iattr->ia_size);
+		if (ret)
+			return ret;
+	}
+
+	setattr_copy(inode, iattr);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/* Zero bytes [@start, @end) of a single block of @inode, up to EOF, through
+ * the page cache. A block that reads as zeros and is not cached is skipped.
+ */
+static int pantryfs_zero_partial(struct inode *inode, loff_t start, loff_t end)
+{
+	struct address_space *mapping = inode->i_mapping;
+	unsigned int state;
+	struct page *page;
+	uint64_t pblk;
+	void *fsdata;
+	int ret;
+
+	end = min(end, i_size_read(inode));
+	if (start >= end)
+		return 0;
+
+	ret = pantryfs_map_blocks(inode, start >> inode->i_blkbits, 1, &pblk,
+		0, &state);
+	if (ret < 0)
+		return ret;
+	page = find_get_page(mapping, start >> PAGE_SHIFT);
+	if (page)
+		put_page(page);
+	else if (!ret || (state & PANTRYFS_MAP_UNWRITTEN))
+		return 0;
+
+	ret = pagecache_write_begin(NULL, mapping, start, end - start, 0,
+		&page, &fsdata);
+	if (ret)
+		return ret;
+	zero_user(page, offset_in_page(start), end - start);
+	ret = pagecache_write_end(NULL, mapping, start, end - start,
+		end - start, page, fsdata);
+	return ret < 0 ? ret : 0;
+}
+
+/* Zero the partial blocks at either edge of [@start, @end), and drop the
+ * cached pages of the whole blocks in between, which are returned in
+ * [*@first, *@last).
+ */
+static int pantryfs_zero_edges(struct inode *inode, loff_t start, loff_t end,
+		uint64_t *first, uint64_t *last)
+{
+	unsigned int bits = inode->i_blkbits;
+	int ret;
+
+	*first = DIV_ROUND_UP(start, 1 << bits);
+	*last = end >> bits;
+	if (*first > *last) {
+		*last = *first;
+		return pantryfs_zero_partial(inode, start, end);
+	}
+
+	ret = pantryfs_zero_partial(inode, start, *first << bits);
+	if (!ret)
+		ret = pantryfs_zero_partial(inode, *last << bits, end);
+	if (!ret && *first < *last)
+		truncate_pagecache_range(inode, *first << bits,
+			(*last << bits) - 1);
+	return ret;
+}
+
+/* fallocate() modes other than plain preallocation, for an inline file. */
+static void pantryfs_inline_zero(struct inode *inode, loff_t start, loff_t end)
+{
+	end = min(end, i_size_read(inode));
+	if (start >= end)
+		return;
+
+	/* Zeroes the range in page 0 too, if it is cached. */
+	truncate_pagecache_range(inode, start, end - 1);
+	down_write(&PFS_I(inode)->map_sem);
+	memset(PFS_INODE(inode)->inline_data + start, 0, end - start);
+	up_write(&PFS_I(inode)->map_sem);
+}
+
+/**
+ * Preallocate, punch or zero [@offset, @offset + @len) of a regular file.
+ * Preallocated blocks go into unwritten extents, so nothing is written to
+ * them and they read as zeros until written. FALLOC_FL_ZERO_RANGE turns the
+ * whole blocks in the range back into unwritten ones. FALLOC_FL_PUNCH_HOLE
+ * frees them.
+ */
+long pantryfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	unsigned int bits = inode->i_blkbits;
+	struct pantryfs_extent_map map;
+	loff_t end = offset + len;
+	uint64_t first, last;
+	int ret;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		     FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+		ret = inode_newsize_ok(inode, end);
+		if (ret)
+			goto out;
+	}
+	inode_dio_wait(inode);
+
+	/* An inline file only needs blocks if the range reaches past the
+	 * inline area and is to be allocated.
+	 */
+	if (pantryfs_has_inline_data(inode) &&
+	    end > PANTRYFS_INLINE_DATA_SIZE &&
+	    !(mode & FALLOC_FL_PUNCH_HOLE) &&
+	    mode != (FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE)) {
+		ret = pantryfs_inline_spill(inode);
+		if (ret)
+			goto out;
+	}
+
+	if (pantryfs_has_inline_data(inode)) {
+		if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+			pantryfs_inline_zero(inode, offset, end);
+		ret = 0;
+		goto update;
+	}
+
+	first = offset >> bits;
+	last = DIV_ROUND_UP(end, 1 << bits);
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		ret = pantryfs_zero_edges(inode, offset, end, &first, &last);
+		if (ret)
+			goto out;
+	}
+
+	down_write(&PFS_I(inode)->map_sem);
+	ret = pantryfs_ext_load(inode, &map);
+	if (ret)
+		goto out_unlock;
+
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		ret = pantryfs_ext_remove(&map, first, last);
+	} else if (mode & FALLOC_FL_ZERO_RANGE) {
+		ret = pantryfs_ext_set_state(&map, first, last, true);
+		/* The partial blocks at the edges are allocated as well. */
+		if (!ret)
+			ret = pantryfs_ext_prealloc(&map, offset >> bits,
+				DIV_ROUND_UP(end, 1 << bits));
+	} else {
+		ret = pantryfs_ext_prealloc(&map, first, last);
+	}
+
+	pantryfs_ext_release(&map);
+out_unlock:
+	up_write(&PFS_I(inode)->map_sem);
+	if (ret)
+		goto out;
+update:
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode))
+		i_size_write(inode, end);
+	inode->i_ctime = current_time(inode);
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+		inode->i_mtime = inode->i_ctime;
+	mark_inode_dirty(inode);
+out:
+	inode_unlock(inode);
+	return ret;
+}
+
+/**
+ * Copy @len bytes from @file_in at @pos_in to @file_out at @pos_out by
+ * copying the source's page cache pages straight into the destination's, so
+ * the data never passes through a pipe or a user buffer. The VFS has already
+ * checked both ranges and cut @len down to the source's size.
+ */
+ssize_t pantryfs_copy_file_range(struct file *file_in, loff_t pos_in,
+		struct file *file_out, loff_t pos_out, size_t len,
+		unsigned int flags)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	struct page *src_page, *dst_page;
+	unsigned int off_in, off_out, n;
+	void *from, *to, *fsdata;
+	loff_t start = pos_out;
+	ssize_t copied = 0;
+	int ret;
+
+	if (src->i_sb != dst->i_sb)
+		return generic_copy_file_range(file_in, pos_in, file_out,
+			pos_out, len, flags);
+
+	inode_lock(dst);
+	ret = file_remove_privs(file_out);
+	if (!ret)
+		ret = file_update_time(file_out);
+
+	while (!ret && len && pos_in < i_size_read(src)) {
+		off_in = offset_in_page(pos_in);
+		off_out = offset_in_page(pos_out);
+		n = min_t(size_t, len, PAGE_SIZE - max(off_in, off_out));
+
+		src_page = read_mapping_page(src->i_mapping,
+			pos_in >> PAGE_SHIFT, NULL);
+		if (IS_ERR(src_page)) {
+			ret = PTR_ERR(src_page);
+			break;
+		}
+		ret = pagecache_write_begin(file_out, dst->i_mapping, pos_out,
+			n, 0, &dst_page, &fsdata);
+		if (ret) {
+			put_page(src_page);
+			break;
+		}
+
+		from = kmap_atomic(src_page);
+		to = kmap_atomic(dst_page);
+		memcpy(to + off_out, from + off_in, n);
+		kunmap_atomic(to);
+		kunmap_atomic(from);
+		flush_dcache_page(dst_page);
+
+		ret = pagecache_write_end(file_out, dst->i_mapping, pos_out, n,
+			n, dst_page, fsdata);
+		put_page(src_page);
+		if (ret <= 0) {
+			ret = ret ? ret : -EIO;
+			break;
+		}
+		pos_in += ret;
+		pos_out += ret;
+		len -= ret;
+		copied += ret;
+		ret = 0;
+
+		balance_dirty_pages_ratelimited(dst->i_mapping);
+		if (fatal_signal_pending(current))
+			ret = -EINTR;
+		cond_resched();
+	}
+	inode_unlock(dst);
+
+	if (copied && (IS_SYNC(dst) || (file_out->f_flags & O_DSYNC))) {
+		ret = vfs_fsync_range(file_out, start, start + copied - 1,
+			!(IS_SYNC(dst) || (file_out->f_flags & __O_SYNC)));
+		if (ret)
+			return ret;
+	}
+	return copied ? copied : ret;
+}
+
+static void pantryfs_release_groups(struct pantryfs_sb_buffer_heads *sbh,
+		uint64_t gdt_blocks)
+{
+	while (gdt_blocks--)
+		brelse(sbh->gdt_bh[gdt_blocks]);
+	kvfree(sbh->gdt_bh);
+	kvfree(sbh->groups);
+}
+
+/* Store the free counts in the on-disk superblock, waiting for it to reach
+ * the disk if @wait is set.
+ */
+static int pantryfs_commit_super(struct super_block *sb, int wait)
+{
+	struct pantryfs_sb_buffer_heads *sbh = PFS_SB(sb);
+	struct pantryfs_super_block *pfs_sb = PFS_DISK_SB(sb);
+
+	lock_buffer(sbh->sb_bh);
+	pfs_sb->free_blocks_count = percpu_counter_sum_positive(&sbh->free_blocks);
+	pfs_sb->free_inodes_count = percpu_counter_sum_positive(&sbh->free_inodes);
+	unlock_buffer(sbh->sb_bh);
+	mark_buffer_dirty(sbh->sb_bh);
+
+	if (wait) {
+		sync_dirty_buffer(sbh->sb_bh);
+		if (buffer_req(sbh->sb_bh) && !buffer_uptodate(sbh->sb_bh))
+			return -EIO;
+	}
+	return 0;
+}
+
+int pantryfs_sync_fs(struct super_block *sb, int wait)
+{
+	return pantryfs_commit_super(sb, wait);
+}
+
+int pantryfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct pantryfs_sb_buffer_heads *sbh = PFS_SB(sb);
+	struct pantryfs_super_block *pfs_sb = PFS_DISK_SB(sb);
+
+	buf->f_type = PANTRYFS_MAGIC_NUMBER;
+	buf->f_bsize = sb->s_blocksize;
+	buf->f_blocks = pfs_sb->blocks_count;
+	/* Blocks reserved for dirty data are as good as used. */
+	buf->f_bfree = max_t(s64, 0,
+		percpu_counter_read_positive(&sbh->free_blocks) -
+		percpu_counter_read_positive(&sbh->dirty_blocks));
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = pfs_sb->inodes_count;
+	buf->f_ffree = percpu_counter_read_positive(&sbh->free_inodes);
+	buf->f_namelen = PANTRYFS_MAX_FILENAME_LENGTH;
+	buf->f_fsid = u64_to_fsid(huge_encode_dev(sb->s_bdev->bd_dev));
+	return 0;
+}
+
+static void pantryfs_destroy_counters(struct pantryfs_sb_buffer_heads *sbh)
+{
+	percpu_counter_destroy(&sbh->free_blocks);
+	percpu_counter_destroy(&sbh->free_inodes);
+	percpu_counter_destroy(&sbh->dirty_blocks);
+	percpu_counter_destroy(&sbh->wb_bios);
+	percpu_counter_destroy(&sbh->wb_pages);
+}
+
+/* Shown in /proc/self/mountstats. */
+int pantryfs_show_stats(struct seq_file *m, struct dentry *root)
+{
+	struct pantryfs_sb_buffer_heads *sbh = PFS_SB(root->d_sb);
+
+	seq_printf(m, "writeback bios %lld pages %lld",
+		percpu_counter_sum(&sbh->wb_bios),
+		percpu_counter_sum(&sbh->wb_pages));
+	return 0;
+}
+
+void pantryfs_put_super(struct super_block *sb)
+{
+	struct pantryfs_sb_buffer_heads *sbh = PFS_SB(sb);
+
+	pantryfs_commit_super(sb, 1);
+	pantryfs_destroy_counters(sbh);
+	pantryfs_release_groups(sbh, PFS_DISK_SB(sb)->gdt_blocks);
+	brelse(sbh->sb_bh);
+	kfree(sbh);
+	sb->s_fs_info = NULL;
+}
+
+/* Check that the metadata of @group lies within the group. */
+static bool pantryfs_check_group(struct super_block *sb, unsigned long group)
+{
+	struct pantryfs_super_block *pfs_sb = PFS_DISK_SB(sb);
+	struct pantryfs_group_desc *gd = pantryfs_group_desc(sb, group, NULL);
+	uint64_t first = group * pfs_sb->blocks_per_group;
+	uint64_t end = first + pantryfs_group_blocks(sb, group);
+
+	return gd->block_bitmap >= first && gd->block_bitmap < end &&
+		gd->inode_bitmap >= first && gd->inode_bitmap < end &&
+		gd->inode_table >= first &&
+		gd->inode_table + pfs_sb->inode_table_blocks <= end;
+}
+
+/* Read in the group descriptor table and set up the per-group state. */
+static int pantryfs_load_groups(struct super_block *sb)
+{
+	struct pantryfs_sb_buffer_heads *sbh = PFS_SB(sb);
+	struct pantryfs_super_block *pfs_sb = PFS_DISK_SB(sb);
+	unsigned long group;
+	uint64_t i;
+
+	/* Both arrays grow with the volume, past what kmalloc can hand out. */
+	sbh->gdt_bh = kvcalloc(pfs_sb->gdt_blocks, sizeof(*sbh->gdt_bh),
+		GFP_KERNEL);
+	sbh->groups = kvcalloc(pfs_sb->groups_count, sizeof(*sbh->groups),
+		GFP_KERNEL);
+	if (!sbh->gdt_bh || !sbh->groups) {
+		pantryfs_release_groups(sbh, 0);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < pfs_sb->gdt_blocks; i++) {
+		sbh->gdt_bh[i] = sb_bread(sb, PANTRYFS_GDT_DATABLOCK_NUMBER + i);
+		if (!sbh->gdt_bh[i]) {
+			pantryfs_release_groups(sbh, i);
+			return -EIO;
+		}
+	}
+
+	for (group = 0; group < pfs_sb->groups_count; group++) {
+		if (!pantryfs_check_group(sb, group)) {
+			pr_err("Pantryfs: bad descriptor for group %lu\n", group);
+			pantryfs_release_groups(sbh, pfs_sb->gdt_blocks);
+			return -EINVAL;
+		}
+		mutex_init(&sbh->groups[group].lock);
+	}
+	return 0;
+}
+
+/* Set up the free counts from the group descriptors, which are updated along
+ * with the bitmaps and so are right even if the superblock's copy is stale.
+ */
+static int pantryfs_init_counters(struct super_block *sb)
+{
+	struct pantryfs_sb_buffer_heads *sbh = PFS_SB(sb);
+	struct pantryfs_group_desc *gd;
+	uint64_t free_blocks = 0, free_inodes = 0;
+	unsigned long group;
+	int ret;
+
+	for (group = 0; group < PFS_DISK_SB(sb)->groups_count; group++) {
+		gd = pantryfs_group_desc(sb, group, NULL);
+		free_blocks += gd->free_blocks_count;
+		free_inodes += gd->free_inodes_count;
+	}
+
+	ret = percpu_counter_init(&sbh->free_blocks, free_blocks, GFP_KERNEL);
+	if (ret)
+		return ret;
+	ret = percpu_counter_init(&sbh->free_inodes, free_inodes, GFP_KERNEL);
+	if (ret)
+		goto destroy_free_blocks;
+	ret = percpu_counter_init(&sbh->dirty_blocks, 0, GFP_KERNEL);
+	if (ret)
+		goto destroy_free_inodes;
+	ret = percpu_counter_init(&sbh->wb_bios, 0, GFP_KERNEL);
+	if (ret)
+		goto destroy_dirty_blocks;
+	ret = percpu_counter_init(&sbh->wb_pages, 0, GFP_KERNEL);
+	if (ret)
+		goto destroy_wb_bios;
+	return 0;
+
+destroy_wb_bios:
+	percpu_counter_destroy(&sbh->wb_bios);
+destroy_dirty_blocks:
+	percpu_counter_destroy(&sbh->dirty_blocks);
+destroy_free_inodes:
+	percpu_counter_destroy(&sbh->free_inodes);
+destroy_free_blocks:
+	percpu_counter_destroy(&sbh->free_blocks);
+	return ret;
 }
 
 int pantryfs_fill_super(struct super_block *sb, void *data, int silent)
 {
-	return -EPERM;
+	struct pantryfs_sb_buffer_heads *sbh;
+	struct pantryfs_super_block *pfs_sb;
+	struct inode *root;
+	int ret;
+
+	sbh = kzalloc(sizeof(*sbh), GFP_KERNEL);
+	if (!sbh)
+		return -ENOMEM;
+	sb->s_fs_info = sbh;
+	spin_lock_init(&sbh->bloom_lock);
+	INIT_LIST_HEAD(&sbh->bloom_list);
+
+	if (!sb_set_blocksize(sb, PFS_BLOCK_SIZE)) {
+		pr_err("Pantryfs: unable to set block size\n");
+		ret = -EINVAL;
+		goto free_sbh;
+	}
+
+	sbh->sb_bh = sb_bread(sb, PANTRYFS_SUPERBLOCK_DATABLOCK_NUMBER);
+	if (!sbh->sb_bh) {
+		ret = -EIO;
+		goto free_sbh;
+	}
+
+	pfs_sb = (struct pantryfs_super_block *) sbh->sb_bh->b_data;
+	if (pfs_sb->magic != PANTRYFS_MAGIC_NUMBER) {
+		if (!silent)
+			pr_err("Pantryfs: wrong magic number: %llu.\n",
+				pfs_sb->magic);
+		ret = -EINVAL;
+		goto release_sb;
+	}
+
+	if (!pfs_sb->blocks_per_group ||
+	    pfs_sb->blocks_per_group > PFS_BITS_PER_BLOCK ||
+	    !pfs_sb->inodes_per_group ||
+	    pfs_sb->inodes_per_group > PFS_BITS_PER_BLOCK ||
+	    pfs_sb->inodes_per_group >
+			pfs_sb->inode_table_blocks * PFS_INODES_PER_BLOCK ||
+	    pfs_sb->groups_count != DIV_ROUND_UP(pfs_sb->blocks_count,
+			pfs_sb->blocks_per_group) ||
+	    pfs_sb->gdt_blocks != DIV_ROUND_UP(pfs_sb->groups_count,
+			PFS_DESC_PER_BLOCK) ||
+	    pfs_sb->inodes_count !=
+			pfs_sb->groups_count * pfs_sb->inodes_per_group) {
+		pr_err("Pantryfs: bad block group geometry\n");
+		ret = -EINVAL;
+		goto release_sb;
+	}
+
+	if (pfs_sb->blocks_count >
+			i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits) {
+		pr_err("Pantryfs: filesystem is larger than the device\n");
+		ret = -EINVAL;
+		goto release_sb;
+	}
+
+	ret = pantryfs_load_groups(sb);
+	if (ret)
+		goto release_sb;
+
+	ret = pantryfs_init_counters(sb);
+	if (ret)
+		goto release_groups;
+
+	sb->s_magic = PANTRYFS_MAGIC_NUMBER;
+	sb->s_op = &pantryfs_sb_ops;
+	sb->s_maxbytes = (loff_t) U32_MAX << sb->s_blocksize_bits;
+	sb->s_time_gran = 1;
+
+	root = pantryfs_iget(sb, PANTRYFS_ROOT_INODE_NUMBER);
+	if (IS_ERR(root)) {
+		ret = PTR_ERR(root);
+		goto destroy_counters;
+	}
+
+	sb->s_root = d_make_root(root);
+	if (!sb->s_root) {
+		ret = -ENOMEM;
+		goto destroy_counters;
+	}
+
+	return 0;
+
+destroy_counters:
+	pantryfs_destroy_counters(sbh);
+release_groups:
+	pantryfs_release_groups(sbh, pfs_sb->gdt_blocks);
+release_sb:
+	brelse(sbh->sb_bh);
+free_sbh:
+	kfree(sbh);
+	sb->s_fs_info = NULL;
+	return ret;
 }
 
 static struct dentry *pantryfs_mount(struct file_system_type *fs_type, int flags,
@@ -134,15 +4481,38 @@ struct file_system_type pantryfs_fs_type = {
 	.kill_sb = pantryfs_kill_superblock,
 };
 
+static void pantryfs_inode_init_once(void *obj)
+{
+	struct pantryfs_inode_info *pi = obj;
+
+	init_rwsem(&pi->map_sem);
+	pi->bloom = NULL;
+	inode_init_once(&pi->vfs_inode);
+}
+
 static int pantryfs_init(void)
 {
 	int ret;
 
+	BUILD_BUG_ON(sizeof(struct pantryfs_inode) != PANTRYFS_INODE_SIZE);
+
+	/* Fast symlink targets are copied to userspace from the inline area. */
+	pantryfs_inode_cachep = kmem_cache_create_usercopy("pantryfs_inode_cache",
+		sizeof(struct pantryfs_inode_info), 0,
+		SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT,
+		offsetof(struct pantryfs_inode_info, pfs.inline_data),
+		sizeof_field(struct pantryfs_inode_info, pfs.inline_data),
+		pantryfs_inode_init_once);
+	if (!pantryfs_inode_cachep)
+		return -ENOMEM;
+
 	ret = register_filesystem(&pantryfs_fs_type);
-	if (likely(ret == 0))
+	if (likely(ret == 0)) {
 		pr_info("Successfully registered mypantryfs\n");
-	else
+	} else {
 		pr_err("Failed to register mypantryfs. Error:[%d]", ret);
+		kmem_cache_destroy(pantryfs_inode_cachep);
+	}
 
 	return ret;
 }
@@ -157,6 +4527,10 @@ static void pantryfs_exit(void)
 		pr_info("Successfully unregistered mypantryfs\n");
 	else
 		pr_err("Failed to unregister mypantryfs. Error:[%d]", ret);
+
+	/* Let RCU-delayed pantryfs_free_inode() calls finish first. */
+	rcu_barrier();
+	kmem_cache_destroy(pantryfs_inode_cachep);
 }
 
 module_init(pantryfs_init);
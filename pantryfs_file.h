@@ -2,13 +2,115 @@
 #define __PANTRYFS_FILE_H__
 /* Directories store a mapping from filename -> inode number. Each of these
  * mappings is a single "directory entry" and is represented by the struct
- * below.
+ * below, followed by the name itself, which is not NUL-terminated.
+ *
+ * Entries are variable-length records packed into the directory's blocks.
+ * rec_len is the distance to the next record in the same block; the last
+ * record of a block extends to the end of it. A record whose inode_no is 0
+ * is unused space, which an entry of up to rec_len bytes can be put into.
+ *
+ * file_type caches the type of the inode, as one of the FT_* values of
+ * <linux/fs_types.h> (the same ones ext2 stores), so that readdir can report
+ * it without reading the inode.
  */
-#define PANTRYFS_FILENAME_BUF_SIZE (256 - 8 - 1)
-#define PANTRYFS_MAX_FILENAME_LENGTH (PANTRYFS_FILENAME_BUF_SIZE - 1)
+#define PANTRYFS_MAX_FILENAME_LENGTH 255
 struct pantryfs_dir_entry {
 	uint64_t inode_no;
-	uint8_t active; /* 0 or 1 */
-	char filename[PANTRYFS_FILENAME_BUF_SIZE];
+	uint16_t rec_len;
+	uint8_t name_len;
+	uint8_t file_type;
+	char filename[];
 };
+
+/* Records are kept 8-byte aligned so inode_no is always aligned. */
+#define PANTRYFS_DIR_ROUND 8
+#define PANTRYFS_DIR_REC_LEN(name_len) \
+	((sizeof(struct pantryfs_dir_entry) + (name_len) + \
+	  PANTRYFS_DIR_ROUND - 1) & ~(PANTRYFS_DIR_ROUND - 1))
+
+/* A directory that outgrows its first block is converted to a hash-indexed
+ * layout if the filesystem has PANTRYFS_FEATURE_DIR_INDEX. The directory's
+ * first block then holds the root of an index that maps filename hashes onto
+ * the directory's other blocks. With levels == 0 the root points straight at
+ * leaf blocks, which hold directory entries as usual. With levels == 1 it
+ * points at index nodes, laid out like the root, which point at the leaves.
+ *
+ * Each index entry covers the hashes from its own hash up to, but excluding,
+ * the next entry's. The first entry of the root has hash 0. The first entry
+ * of an index node starts the node's range, so it has the hash of the root
+ * entry pointing at the node. Lookups never compare against it.
+ *
+ * Index blocks start with an unused record spanning the whole block, so code
+ * walking the directory's records, such as readdir, skips over them.
+ */
+#define PANTRYFS_DX_MAGIC 0x000d1e70
+#define PANTRYFS_DX_MAX_LEVELS 1
+
+struct pantryfs_dx_entry {
+	uint32_t hash;
+	uint32_t block;		/* Logical block within the directory */
+};
+
+struct pantryfs_dx_block {
+	uint64_t fake_inode_no;	/* Always 0 */
+	uint16_t fake_rec_len;	/* Always PFS_BLOCK_SIZE */
+	uint8_t fake_name_len;
+	uint8_t fake_file_type;
+	uint32_t magic;
+	uint16_t count;		/* Number of entries in use */
+	uint8_t levels;		/* Only meaningful in the root */
+	uint8_t __unused;
+	struct pantryfs_dx_entry entries[];
+};
+
+#define PANTRYFS_DX_LIMIT \
+	((PFS_BLOCK_SIZE - sizeof(struct pantryfs_dx_block)) / \
+	 sizeof(struct pantryfs_dx_entry))
+
+#ifdef __KERNEL__
+/* With PANTRYFS_FEATURE_DIR_INDEX, readdir lists every directory in hash
+ * order. Past the dots, f_pos is 2 plus the name's hash shifted above
+ * PANTRYFS_DIR_MINOR_BITS bits of a second hash, or PANTRYFS_DIR_HASH_EOF
+ * once the listing is done.
+ *
+ * Callers that can only take 32-bit positions, such as compat getdents()
+ * and NFS clients with 32-bit cookies, get 2 plus the name's hash shifted
+ * down by PANTRYFS_DIR_POS32_SHIFT instead, and PANTRYFS_DIR_HASH_EOF_32BIT.
+ */
+#define PANTRYFS_DIR_MINOR_BITS 30
+#define PANTRYFS_DIR_HASH_EOF (2 + (1LL << (32 + PANTRYFS_DIR_MINOR_BITS)))
+#define PANTRYFS_DIR_POS32_SHIFT 2
+#define PANTRYFS_DIR_HASH_EOF_32BIT 0x7fffffffLL
+
+/* Readdir state of an open directory, kept in file->private_data. */
+struct pantryfs_dir_cursor {
+	loff_t pos;	/* ctx->pos the last readdir stopped at, or -1 */
+	u64 version;	/* Directory i_version at that point */
+
+	/* In hash order, the last name listed, its position (or -1) and hash. */
+	loff_t last_pos;
+	u32 last_hash;
+	u8 last_len;
+	char last_name[PANTRYFS_MAX_FILENAME_LENGTH];
+};
+
+/* In-memory bloom filter of the names in a directory, built by the first
+ * lookup in it. A name it does not contain is known not to exist without
+ * reading the directory. PANTRYFS_BLOOM_PROBES bits are set per name.
+ */
+#define PANTRYFS_BLOOM_PROBES 3
+#define PANTRYFS_BLOOM_BITS_PER_NAME 8
+#define PANTRYFS_BLOOM_MIN_NAMES 32U
+#define PANTRYFS_BLOOM_MAX_SHIFT 20
+
+struct pantryfs_dir_bloom {
+	struct list_head list;	/* On the superblock's bloom_list */
+	struct pantryfs_inode_info *owner;
+	struct rcu_head rcu;
+	unsigned int bits_shift; /* log2 of the number of bits in map */
+	unsigned int limit;	/* Number of names the filter is sized for */
+	unsigned int added;	/* Names added since it was built */
+	unsigned long map[];
+};
+#endif /* ifdef __KERNEL__ */
 #endif /* ifndef __PANTRYFS_FILE_H__ */
@@ -1,21 +1,74 @@
 #ifndef __PANTRYFS_FILE_OPS_H__
 #define __PANTRYFS_FILE_OPS_H__
-int pantryfs_iterate(struct file *filp, struct dir_context *ctx);
-ssize_t pantryfs_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos);
+int pantryfs_dir_open(struct inode *inode, struct file *filp);
+int pantryfs_dir_release(struct inode *inode, struct file *filp);
+int pantryfs_iterate_shared(struct file *filp, struct dir_context *ctx);
+loff_t pantryfs_dir_llseek(struct file *filp, loff_t offset, int whence);
+int pantryfs_open(struct inode *inode, struct file *filp);
 loff_t pantryfs_llseek(struct file *filp, loff_t offset, int whence);
-ssize_t pantryfs_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos);
 int pantryfs_fsync(struct file *filp, loff_t start, loff_t end, int datasync);
+int pantryfs_file_mmap(struct file *filp, struct vm_area_struct *vma);
+long pantryfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len);
+ssize_t pantryfs_copy_file_range(struct file *file_in, loff_t pos_in,
+	struct file *file_out, loff_t pos_out, size_t len, unsigned int flags);
+vm_fault_t pantryfs_page_mkwrite(struct vm_fault *vmf);
+
+int pantryfs_readpage(struct file *file, struct page *page);
+void pantryfs_readahead(struct readahead_control *rac);
+int pantryfs_writepage(struct page *page, struct writeback_control *wbc);
+int pantryfs_writepages(struct address_space *mapping,
+	struct writeback_control *wbc);
+int pantryfs_write_begin(struct file *file, struct address_space *mapping,
+	loff_t pos, unsigned int len, unsigned int flags,
+	struct page **pagep, void **fsdata);
+int pantryfs_write_end(struct file *file, struct address_space *mapping,
+	loff_t pos, unsigned int len, unsigned int copied,
+	struct page *page, void *fsdata);
+void pantryfs_invalidatepage(struct page *page, unsigned int offset,
+	unsigned int length);
+int pantryfs_releasepage(struct page *page, gfp_t gfp);
+ssize_t pantryfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter);
+sector_t pantryfs_bmap(struct address_space *mapping, sector_t block);
 
 const struct file_operations pantryfs_dir_ops = {
 	.owner = THIS_MODULE,
-	.iterate = pantryfs_iterate
+	.open = pantryfs_dir_open,
+	.release = pantryfs_dir_release,
+	.llseek = pantryfs_dir_llseek,
+	.read = generic_read_dir,
+	.iterate_shared = pantryfs_iterate_shared
 };
 
 const struct file_operations pantryfs_file_ops = {
 	.owner = THIS_MODULE,
-	.read = pantryfs_read,
-	.write = pantryfs_write,
+	.open = pantryfs_open,
+	.read_iter = generic_file_read_iter,
+	.write_iter = generic_file_write_iter,
 	.llseek = pantryfs_llseek,
-	.fsync = pantryfs_fsync
+	.mmap = pantryfs_file_mmap,
+	.fsync = pantryfs_fsync,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+	.copy_file_range = pantryfs_copy_file_range,
+	.fallocate = pantryfs_fallocate
+};
+
+const struct vm_operations_struct pantryfs_file_vm_ops = {
+	.fault = filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = pantryfs_page_mkwrite
+};
+
+const struct address_space_operations pantryfs_aops = {
+	.readpage = pantryfs_readpage,
+	.readahead = pantryfs_readahead,
+	.writepage = pantryfs_writepage,
+	.writepages = pantryfs_writepages,
+	.write_begin = pantryfs_write_begin,
+	.write_end = pantryfs_write_end,
+	.invalidatepage = pantryfs_invalidatepage,
+	.releasepage = pantryfs_releasepage,
+	.direct_IO = pantryfs_direct_IO,
+	.bmap = pantryfs_bmap
 };
 #endif /* ifndef __PANTRYFS_FILE_OPS_H__ */
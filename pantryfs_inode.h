@@ -1,12 +1,85 @@
 #ifndef __PANTRYFS_INODE_H__
 #define __PANTRYFS_INODE_H__
+/* A file's data is described by a list of extents. Each extent maps a run of
+ * consecutive logical blocks of the file onto a run of physically contiguous
+ * device blocks, so a file written sequentially needs only a handful of them.
+ */
+struct pantryfs_extent {
+	uint32_t ee_block;	/* First logical block covered by the extent */
+	uint32_t ee_len;	/* Number of blocks covered by the extent */
+	uint64_t ee_start;	/* Device block backing ee_block */
+};
+
+/* The top bit of ee_len marks an unwritten extent: its blocks are allocated,
+ * as by fallocate(), but have never been written and read back as zeros. It
+ * becomes an ordinary extent block by block as data is written to it.
+ */
+#define PANTRYFS_EXT_UNWRITTEN 0x80000000U
+#define PANTRYFS_EXT_MAX_LEN (PANTRYFS_EXT_UNWRITTEN - 1)
+
+/* The first PANTRYFS_INLINE_EXTENTS extents of a file are stored in its inode.
+ * Any extents past those go to extent blocks, or leaves, whose layout is
+ * given below. A leaf holds at least one extent; a full one is split in two
+ * and one running low is merged with a neighbour. A single leaf is pointed at
+ * by the inode. With more, the inode has PANTRYFS_EXT_INDEX_FL and points at
+ * an extent index block listing them in order, each under the first logical
+ * block it maps. Extents are kept sorted by ee_block across all of these, and
+ * the inode's slots are all taken before any leaf is.
+ */
+#define PANTRYFS_INLINE_EXTENTS 4
+#define PANTRYFS_EXTENT_MAGIC 0x00e87e47
+
+struct pantryfs_extent_block {
+	uint32_t magic;
+	uint32_t count;		/* Number of extents stored in this block */
+	uint64_t owner;		/* Inode number of the file this block maps */
+	struct pantryfs_extent extents[];
+};
+
+#define PANTRYFS_EXTENTS_PER_BLOCK \
+	((PFS_BLOCK_SIZE - sizeof(struct pantryfs_extent_block)) / \
+	 sizeof(struct pantryfs_extent))
+
+#define PANTRYFS_EXTENT_INDEX_MAGIC 0x00e87e1d
+
+struct pantryfs_extent_index_entry {
+	uint32_t ee_block;	/* First logical block mapped by the leaf */
+	uint32_t reserved;
+	uint64_t block;		/* Device block of the leaf */
+};
+
+struct pantryfs_extent_index {
+	uint32_t magic;
+	uint32_t count;		/* Number of extent blocks listed */
+	uint64_t owner;		/* Inode number of the file this block maps */
+	struct pantryfs_extent_index_entry entries[];
+};
+
+#define PANTRYFS_EXT_MAX_LEAVES \
+	((PFS_BLOCK_SIZE - sizeof(struct pantryfs_extent_index)) / \
+	 sizeof(struct pantryfs_extent_index_entry))
+
+/* Inode flags. */
+#define PANTRYFS_INDEX_FL 0x00000001 /* Directory uses a hashed index */
+#define PANTRYFS_INLINE_DATA_FL 0x00000002 /* Data is stored in the inode */
+#define PANTRYFS_EXT_INDEX_FL 0x00000004 /* ext_block is an extent index */
+
+/* Inodes are 256 bytes. A regular file no bigger than
+ * PANTRYFS_INLINE_DATA_SIZE keeps its contents in the inode, in place of the
+ * extent map, and needs no data block at all. The file is moved to a data
+ * block once it grows past that. Bytes of the inline area past the end of
+ * the file are always zero.
+ */
+#define PANTRYFS_INODE_SIZE 256
+#define PANTRYFS_INLINE_DATA_SIZE 176
+
 /* An inode contains metadata about the file it represents. This includes
  * permissions, access times, size, etc. All the stuff you can see with the ls
  * command is taken right from the inode.
  *
  * Note that the inode does not contain the file data itself. But it must
- * contain information to find the file data. In our case, we store the block
- * number where the data is.
+ * contain information to find the file data. In our case, we store the
+ * file's extent map.
  */
 struct pantryfs_inode {
 	/* What kind of file this is (i.e. directory, plain old file, etc). */
@@ -21,12 +94,51 @@ struct pantryfs_inode {
 	struct timespec64 i_mtime; /* Modified time */
 	struct timespec64 i_ctime; /* Change time */
 
-	/* The device block where the data starts for this file. */
-	uint64_t data_block_number;
+	/* Total number of extents in the map, inline ones included. */
+	uint32_t ext_count;
+
+	uint32_t flags; /* PANTRYFS_*_FL */
 
 	/* A file can be a directory or a plain file. In the latter case
-	 * we store the file size. Each directory's size is 4096.
+	 * we store the file size. A directory's size is 4096 times the number
+	 * of blocks it spans.
 	 */
 	uint64_t file_size;
+
+	union {
+		struct {
+			/* The device block holding the overflow extents, or
+			 * their index, or 0 if none.
+			 */
+			uint64_t ext_block;
+
+			struct pantryfs_extent extents[PANTRYFS_INLINE_EXTENTS];
+		};
+		/* With PANTRYFS_INLINE_DATA_FL, the file's contents. */
+		char inline_data[PANTRYFS_INLINE_DATA_SIZE];
+	};
+};
+
+#ifdef __KERNEL__
+/* In-memory inode, allocated from pantryfs_inode_cachep. Along with the VFS
+ * inode it holds the inode's on-disk record, extent map, flags and inline
+ * data included, which pantryfs_write_inode() stores back into the inode
+ * table.
+ */
+struct pantryfs_inode_info {
+	struct pantryfs_inode pfs;
+
+	/* Protects the union in @pfs, the overflow extent block and
+	 * PANTRYFS_INLINE_DATA_FL. Taken before any group lock.
+	 */
+	struct rw_semaphore map_sem;
+
+	/* Name filter of a directory, or NULL. Set and cleared under the
+	 * superblock's bloom_lock, and freed after an RCU grace period.
+	 */
+	struct pantryfs_dir_bloom __rcu *bloom;
+
+	struct inode vfs_inode;
 };
+#endif /* ifdef __KERNEL__ */
 #endif /* ifndef __PANTRYFS_INODE_H__ */
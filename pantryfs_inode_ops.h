@@ -8,8 +8,7 @@ int pantryfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
 int pantryfs_rmdir(struct inode *dir, struct dentry *dentry);
 int pantryfs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *dentry);
 int pantryfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname);
-const char *pantryfs_get_link(struct dentry *dentry, struct inode *inode,
-	struct delayed_call *done);
+int pantryfs_setattr(struct dentry *dentry, struct iattr *iattr);
 
 const struct inode_operations pantryfs_inode_ops = {
 	.lookup = pantryfs_lookup,
@@ -21,7 +20,15 @@ const struct inode_operations pantryfs_inode_ops = {
 	.symlink = pantryfs_symlink,
 };
 
+const struct inode_operations pantryfs_file_inode_ops = {
+	.setattr = pantryfs_setattr
+};
+
 const struct inode_operations pantryfs_symlink_inode_ops = {
-	.get_link = pantryfs_get_link
+	.get_link = page_get_link
+};
+
+const struct inode_operations pantryfs_fast_symlink_inode_ops = {
+	.get_link = simple_get_link
 };
 #endif /* ifndef __PANTRY_FS_INODE_OPS_H__ */
@@ -3,16 +3,13 @@
 #include "pantryfs_inode.h"
 #include "pantryfs_file.h"
 
-/* Macros to set, test, and clear a bit array of integers. */
+/* Macros to set, test, and clear a bit array of integers. These match the
+ * little-endian bit order the kernel's *_bit_le() helpers use on the bitmaps.
+ */
 #define SETBIT(A, k)     (A[((k) / 32)] |=  (1 << ((k) % 32)))
 #define CLEARBIT(A, k)   (A[((k) / 32)] &= ~(1 << ((k) % 32)))
 #define IS_SET(A, k)     (A[((k) / 32)] &   (1 << ((k) % 32)))
 
-/* This macro will declare a bit vector. I use it to declare an array of the
- * right size inside the pantryfs_sb.
- */
-#define DECLARE_BIT_VECTOR(name, size) uint32_t name[(size / 32) + 1];
-
 #define PANTRYFS_MAGIC_NUMBER  0x00004118
 #define PFS_BLOCK_SIZE 4096
 
@@ -25,23 +22,55 @@
 /*  Data block #  |  Contents
  * -------------------------------
  *	0	  |  Superblock
- *	1         |  Inode Store
- *	2         |  Root Data Block
+ *	1         |  Group descriptor table (gdt_blocks blocks)
+ *	...       |  Group 0: block bitmap, inode bitmap, inode table, data
+ *	32768     |  Group 1: block bitmap, inode bitmap, inode table, data
+ *	...       |  ...
+ *
+ * The device is split into block groups of blocks_per_group blocks. Group g
+ * starts at block g * blocks_per_group; only the last group may be shorter.
+ * Each group has a one-block bitmap of its blocks, a one-block bitmap of its
+ * inodes_per_group inodes and its share of the inode table
+ * (inode_table_blocks blocks), as located by the group's descriptor. Bit k of
+ * a group's block bitmap tracks block k of the group, so blocks holding
+ * metadata are always marked in use. The root directory's data is the first
+ * data block of group 0.
  */
 #define PANTRYFS_SUPERBLOCK_DATABLOCK_NUMBER 0
-#define PANTRYFS_INODE_STORE_DATABLOCK_NUMBER 1
-#define PANTRYFS_ROOT_DATABLOCK_NUMBER 2
+#define PANTRYFS_GDT_DATABLOCK_NUMBER 1
 
-/* The inode store is one 4096 byte-block. The following macro calculates
- * how many pantryfs_inodes we can shove in the inode store.
+struct pantryfs_group_desc {
+	uint64_t block_bitmap;		/* Device block of the block bitmap */
+	uint64_t inode_bitmap;		/* Device block of the inode bitmap */
+	uint64_t inode_table;		/* First device block of the inode table */
+	uint32_t free_blocks_count;
+	uint16_t free_inodes_count;
+	uint16_t used_dirs_count;	/* Number of directories in the group */
+};
+
+/* Each inode table block holds this many pantryfs_inodes. Inode number ino
+ * belongs to group (ino - 1) / inodes_per_group, where it is entry
+ * (ino - 1) % inodes_per_group of the inode table.
  */
-#define PFS_MAX_INODES (PFS_BLOCK_SIZE / sizeof(struct pantryfs_inode))
-#define PFS_MAX_CHILDREN ((loff_t) (PFS_BLOCK_SIZE / sizeof(struct pantryfs_dir_entry)))
+#define PFS_INODES_PER_BLOCK (PFS_BLOCK_SIZE / sizeof(struct pantryfs_inode))
+#define PFS_BITS_PER_BLOCK (PFS_BLOCK_SIZE * 8)
+#define PFS_DESC_PER_BLOCK (PFS_BLOCK_SIZE / sizeof(struct pantryfs_group_desc))
+
+/* Optional features, recorded in the superblock's features field. */
+#define PANTRYFS_FEATURE_DIR_INDEX 0x00000001 /* Hashed directory index */
 
 #define PFS_SB_MEMBERS uint64_t version;\
 	uint64_t magic;\
-	DECLARE_BIT_VECTOR(free_inodes, PFS_MAX_INODES);\
-	DECLARE_BIT_VECTOR(free_data_blocks, PFS_MAX_INODES);
+	uint64_t features;\
+	uint64_t blocks_count;\
+	uint64_t inodes_count;\
+	uint64_t blocks_per_group;\
+	uint64_t inodes_per_group;\
+	uint64_t groups_count;\
+	uint64_t gdt_blocks;\
+	uint64_t inode_table_blocks;\
+	uint64_t free_blocks_count;\
+	uint64_t free_inodes_count;
 
 /* This is the superblock, as it will be serialized onto the disk. */
 struct pantryfs_super_block {
@@ -51,12 +80,51 @@ struct pantryfs_super_block {
 	char __padding__[PFS_BLOCK_SIZE - sizeof(struct {PFS_SB_MEMBERS})];
 };
 
-/* In the VFS superblock, we need to have a pointer to the buffer_heads for the
- * inode store and superblock so that we can mark them as dirty when they're
- * modified inode.
+#ifdef __KERNEL__
+struct pantryfs_group_info {
+	/* Protects the group's bitmaps and the counts in its descriptor. No
+	 * other group lock may be taken while holding it.
+	 */
+	struct mutex lock;
+
+	/* Every block and inode of the group below these is in use, so
+	 * searches for a free one start here instead of at bit 0.
+	 */
+	unsigned long block_hint;
+	unsigned long inode_hint;
+} ____cacheline_aligned_in_smp;
+
+/* In the VFS superblock, we need to have a pointer to the buffer_head for the
+ * superblock so that we can mark it as dirty when it's modified. The group
+ * descriptor table is kept in memory too. Bitmaps and inode table blocks are
+ * read on demand.
+ *
+ * The free block and inode counts are kept in per-CPU counters, which are
+ * written back to the on-disk superblock when the filesystem is synced.
  */
 struct pantryfs_sb_buffer_heads {
 	struct buffer_head *sb_bh;
-	struct buffer_head *i_store_bh;
+	struct buffer_head **gdt_bh;
+	struct pantryfs_group_info *groups;
+
+	/* The counters are folded into under their own locks; keep each on
+	 * its own cacheline, away from the read-mostly pointers above.
+	 */
+	struct percpu_counter free_blocks ____cacheline_aligned_in_smp;
+	struct percpu_counter free_inodes ____cacheline_aligned_in_smp;
+	/* Free blocks promised to dirty pages awaiting delayed allocation. */
+	struct percpu_counter dirty_blocks ____cacheline_aligned_in_smp;
+
+	/* Bios built and pages batched into them by ->writepages. Pages it
+	 * hands to block_write_full_page() are not counted.
+	 */
+	struct percpu_counter wb_bios ____cacheline_aligned_in_smp;
+	struct percpu_counter wb_pages;
+
+	/* Directory name filters, oldest first, for the shrinker. */
+	spinlock_t bloom_lock ____cacheline_aligned_in_smp;
+	struct list_head bloom_list;
+	unsigned long nr_blooms;
 };
+#endif /* ifdef __KERNEL__ */
 #endif /* ifndef __PANTRYFS_SB_H__ */
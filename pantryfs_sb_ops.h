@@ -1,12 +1,28 @@
 #ifndef __PANTRYFS_SB_OPS_H__
 #define __PANTRYFS_SB_OPS_H__
+struct inode *pantryfs_alloc_inode(struct super_block *sb);
 void pantryfs_evict_inode(struct inode *inode);
 int pantryfs_write_inode(struct inode *inode, struct writeback_control *wbc);
 void pantryfs_free_inode(struct inode *inode);
+void pantryfs_put_super(struct super_block *sb);
+int pantryfs_sync_fs(struct super_block *sb, int wait);
+int pantryfs_statfs(struct dentry *dentry, struct kstatfs *buf);
+int pantryfs_show_stats(struct seq_file *m, struct dentry *root);
+long pantryfs_nr_cached_objects(struct super_block *sb,
+	struct shrink_control *sc);
+long pantryfs_free_cached_objects(struct super_block *sb,
+	struct shrink_control *sc);
 
 struct super_operations pantryfs_sb_ops = {
+	.alloc_inode = pantryfs_alloc_inode,
 	.evict_inode = pantryfs_evict_inode,
 	.write_inode = pantryfs_write_inode,
 	.free_inode = pantryfs_free_inode,
+	.put_super = pantryfs_put_super,
+	.sync_fs = pantryfs_sync_fs,
+	.statfs = pantryfs_statfs,
+	.show_stats = pantryfs_show_stats,
+	.nr_cached_objects = pantryfs_nr_cached_objects,
+	.free_cached_objects = pantryfs_free_cached_objects,
 };
 #endif /* ifndef __PANTRYFS_SB_OPS_H__ */